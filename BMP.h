@@ -1,11 +1,70 @@
-#include <fstream>
 #include <string>
 #include <exception>
+#include <stdexcept>
 #include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <new>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-class BMP
+namespace bmp_detail
 {
-private:
+    inline void put32(unsigned char* field, std::uint32_t value)
+    {
+        field[0] = (unsigned char)(value);
+        field[1] = (unsigned char)(value >> 8);
+        field[2] = (unsigned char)(value >> 16);
+        field[3] = (unsigned char)(value >> 24);
+    }
+
+    inline std::uint32_t get32(const unsigned char* field)
+    {
+        return field[0] | (field[1] << 8) | (field[2] << 16) | ((std::uint32_t)field[3] << 24);
+    }
+
+    // Rows in the file are padded to a multiple of four bytes.
+    inline std::size_t rowSize(unsigned int width, unsigned int bpp)
+    {
+        return ((std::size_t)width * bpp + 31) / 32 * 4;
+    }
+
+    // What follows the header: the RGB 3-3-2 palette at 8 bpp, the channel
+    // masks of BI_BITFIELDS at 16 and 32 bpp, nothing at 24 bpp.
+    inline std::vector<unsigned char> colorTable(unsigned int bpp)
+    {
+        std::vector<unsigned char> table;
+        if(bpp == 8) {
+            table.resize(256 * 4);
+            for(unsigned int i = 0; i < 256; ++i) {
+                table[i * 4 + 0] = (unsigned char)((i & 3) * 255 / 3);
+                table[i * 4 + 1] = (unsigned char)(((i >> 2) & 7) * 255 / 7);
+                table[i * 4 + 2] = (unsigned char)(((i >> 5) & 7) * 255 / 7);
+            }
+        } else if(bpp == 16 || bpp == 32) {
+            table.resize(12);
+            put32(&table[0], bpp == 16 ? 0xF800 : 0x00FF0000);
+            put32(&table[4], bpp == 16 ? 0x07E0 : 0x0000FF00);
+            put32(&table[8], bpp == 16 ? 0x001F : 0x000000FF);
+        }
+        return table;
+    }
 
     struct BMPFILEHEADER
     {
@@ -17,7 +76,7 @@ private:
         unsigned char    info_size    [4] {40, 0, 0, 0};
         unsigned char    width        [4] {0, 0, 0, 0};
         unsigned char    height       [4] {0, 0, 0, 0};
-        unsigned char    planes       [2] {0, 0};
+        unsigned char    planes       [2] {1, 0};
         unsigned char    bpp          [2] {24, 0};
         unsigned char    compression  [4] {0, 0, 0, 0};
         unsigned char    sizeImage    [4] {0, 0, 0, 0};
@@ -28,28 +87,108 @@ private:
 
         BMPFILEHEADER() = default;
 
-        BMPFILEHEADER(unsigned int _width, unsigned int _height, unsigned int _bpp)
+        // A negative height marks the rows as stored top to bottom.
+        BMPFILEHEADER(unsigned int _width, unsigned int _height, unsigned int _bpp, bool top_down)
         {
+            const std::uint32_t table = colorTable(_bpp).size();
+            const std::uint32_t image = rowSize(_width, _bpp) * _height;
+            put32(offBits, 54 + table);
+            put32(size, 54 + table + image);
+            put32(width, _width);
+            put32(height, top_down ? (std::uint32_t)(-(std::int64_t)_height) : _height);
+            bpp[0] = _bpp;
+            put32(compression, (_bpp == 16 || _bpp == 32) ? 3 : 0);
+            put32(sizeImage, image);
+            put32(clrUsed, _bpp == 8 ? 256 : 0);
+        }
+    };
 
-            unsigned int _size = _width * _height * (_bpp / 8);
-            size[0] = (unsigned char)(_size);
-            size[1] = (unsigned char)(_size >> 8);
-            size[2] = (unsigned char)(_size >> 16);
-            size[3] = (unsigned char)(_size >> 24);
+    // Every pixel buffer BMP allocates or frees is counted here.
+    struct Counters
+    {
+        std::atomic<std::size_t> allocations { 0 };
+        std::atomic<std::size_t> releases { 0 };
+        std::atomic<std::size_t> bytes { 0 };
+    };
 
-            width[0] = (unsigned char)(_width);
-            width[1] = (unsigned char)(_width >> 8);
-            width[2] = (unsigned char)(_width >> 16);
-            width[3] = (unsigned char)(_width >> 24);
+    inline Counters counters;
 
-            height[0] = (unsigned char)(_height);
-            height[1] = (unsigned char)(_height >> 8);
-            height[2] = (unsigned char)(_height >> 16);
-            height[3] = (unsigned char)(_height >> 24);
+    // Pixel buffers start on a cache line, which the vector stores in span
+    // and the row copies of write and copy assignment benefit from.
+    inline unsigned char* allocate(std::size_t size)
+    {
+        unsigned char* buffer = static_cast<unsigned char*>(::operator new(size, std::align_val_t(64)));
+        counters.allocations.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes.fetch_add(size, std::memory_order_relaxed);
+        return buffer;
+    }
 
-            bpp[0] = _bpp;
+    inline void deallocate(unsigned char* buffer)
+    {
+        if(buffer == nullptr) { return; }
+        counters.releases.fetch_add(1, std::memory_order_relaxed);
+        ::operator delete(buffer, std::align_val_t(64));
+    }
+
+    template <typename F>
+    void parallelFor(unsigned int count, F&& fn)
+    {
+        std::vector<std::thread> workers;
+        workers.reserve(count - 1);
+        for(unsigned int i = 1; i < count; ++i) {
+            workers.emplace_back([&fn, i]() { fn(i); });
         }
-    };
+        fn(0);
+        for(auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Hands the whole iovec list to writev(), again for whatever a short write
+    // leaves, adjusting the entries in place.
+    inline void writeAll(int fd, std::vector<iovec>& iov)
+    {
+        std::size_t first = 0;
+        while(first < iov.size()) {
+            ssize_t n = ::writev(fd, iov.data() + first, std::min<std::size_t>(iov.size() - first, IOV_MAX));
+            if(n < 0 && errno == EINTR) { continue; }
+            if(n < 0) {
+                throw std::runtime_error(std::string("Failed to write the BMP file: ") + std::strerror(errno));
+            }
+            std::size_t written = n;
+            while(first < iov.size() && written >= iov[first].iov_len) {
+                written -= iov[first].iov_len;
+                first++;
+            }
+            if(first < iov.size()) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+                iov[first].iov_len -= written;
+            }
+        }
+    }
+
+    // write() of one contiguous buffer, retried until all of it is out.
+    inline void writeFully(int fd, const unsigned char* data, std::size_t size)
+    {
+        while(size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if(n < 0 && errno == EINTR) { continue; }
+            if(n < 0) {
+                throw std::runtime_error(std::string("Failed to write the BMP file: ") + std::strerror(errno));
+            }
+            data += n;
+            size -= n;
+        }
+    }
+}
+
+// Row 0 is the bottom of the image and rows are getStride() bytes apart, which
+// is the packed row size unless the image was opened from a file. 8 bpp pixels
+// index the RGB 3-3-2 palette, 16 bpp pixels are RGB 5-6-5 and 24 and 32 bpp
+// pixels are B, G, R (, unused).
+class BMP
+{
+private:
 
     struct Pixel
     {
@@ -66,11 +205,11 @@ private:
             b = value;
         }
 
-        Pixel(unsigned char r, unsigned char g, unsigned char b)
+        Pixel(unsigned char _r, unsigned char _g, unsigned char _b)
         {
-            r = r;
-            g = g;
-            b = b;
+            r = _r;
+            g = _g;
+            b = _b;
         }
 
         bool operator==(const Pixel& o) const
@@ -83,244 +222,1160 @@ public:
 
     BMP() = default;
 
-    BMP(const std::string& _file_name, unsigned int _width, unsigned int _height, unsigned int _bpp = 24) : file_name(_file_name), width(_width), height(_height), bpp(_bpp)
+    BMP(const std::string& _file_name, unsigned int _width, unsigned int _height, unsigned int _bpp = 24) : width(_width), height(_height), bpp(_bpp), file_name(_file_name)
     {
-        if(_file_name == "") {
-            throw std::invalid_argument("File name cannot be blank.");
+        validate(_file_name, _width, _height, _bpp);
+        const std::size_t bytes = (std::size_t)width * height * pixelSize();
+        reserve(bytes);
+        std::memset(pixels, 0, bytes);
+        stride = (std::ptrdiff_t)width * pixelSize();
+    }
+
+    struct AllocationStats
+    {
+        std::size_t allocations;
+        std::size_t releases;
+        std::size_t bytes;
+    };
+
+    // Pixel buffers allocated and freed by every BMP so far, and the bytes
+    // allocated, for checking that a frame loop has stopped allocating.
+    static AllocationStats allocationStats()
+    {
+        return AllocationStats {
+            bmp_detail::counters.allocations.load(std::memory_order_relaxed),
+            bmp_detail::counters.releases.load(std::memory_order_relaxed),
+            bmp_detail::counters.bytes.load(std::memory_order_relaxed)
+        };
+    }
+
+    // Maps a bitmap file instead of reading it. When the file stores pixels
+    // the way BMP does, they are used in place, and drawing only copies the
+    // pages it touches. Other formats (1 and 4 bpp, other palettes or channel
+    // masks) are converted to 24 bpp the first time the pixels are needed.
+    static BMP open(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw std::runtime_error(path + " could not be opened for reading.");
         }
 
-        if(_width == 0 || _height == 0) {
-            throw std::invalid_argument("Width and Height cannot be equal to zero.");
+        struct stat info;
+        if(::fstat(fd, &info) != 0 || info.st_size < 54) {
+            ::close(fd);
+            throw std::runtime_error(path + " is not a valid bitmap: the file is too small.");
         }
 
-        if(_bpp != 8 && _bpp != 16 && _bpp != 24 && _bpp != 32) {
-            throw std::invalid_argument("Bits per pixel must be 8, 16, 24, or 32.");
+        void* data = ::mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(data == MAP_FAILED) {
+            throw std::runtime_error(path + " could not be mapped: " + std::strerror(errno));
         }
 
-        pixels = new unsigned char[width * height * (bpp / 8)]();
-        header = BMPFILEHEADER(width, height, bpp);
+        BMP image;
+        image.file_name = path;
+        image.mapping = static_cast<unsigned char*>(data);
+        image.mapping_size = info.st_size;
+        image.attach();
+        return image;
     }
 
+    // Keeps the current buffer when the new size fits in it. A BMP without
+    // pixels gets a buffer even when the size is the one it already reports.
     bool setSize(unsigned int _width, unsigned int _height)
     {
-        if(_width == width && _height == height) { return false; }
-        header = BMPFILEHEADER(_width, _height, bpp);
-        delete[] pixels;
-        pixels = new unsigned char[_width * _height * (bpp / 8)]();
+        if(pixels != nullptr && _width == width && _height == height) { return false; }
+        const std::size_t bytes = (std::size_t)_width * _height * pixelSize();
+        reserve(bytes);
+        std::memset(pixels, 0, bytes);
         width = _width;
         height = _height;
+        stride = (std::ptrdiff_t)width * pixelSize();
         return true;
     }
 
+    // Writes the header and the padded rows with a single writev, pointing
+    // straight into the pixel buffer. An image that still maps its file is
+    // written next to it and renamed over it, so the mapping stays valid.
     bool write()
     {
-        if(pixels == nullptr) {
-            throw std::runtime_error("Pixel buffer must be set by calling setSize or the BMP constructor.");
+        require();
+
+        const std::string path = mapping != nullptr ? file_name + ".tmp" : file_name;
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            return false;
         }
 
-        std::ofstream file(file_name);
-        if(file.is_open())
-        {
-            file.write((char*)(&header), header.offBits[0]);
-            file.write((char*)pixels, width * height * (bpp / 8));
-            file.close();
-            return true;
+        const bmp_detail::BMPFILEHEADER header(width, height, bpp, top_down);
+        const std::vector<unsigned char> table = bmp_detail::colorTable(bpp);
+        static const unsigned char padding[4] {0, 0, 0, 0};
+        const std::size_t row = (std::size_t)width * pixelSize();
+        const std::size_t pad = bmp_detail::rowSize(width, bpp) - row;
+
+        std::vector<iovec> iov;
+        iov.push_back(iovec { (void*)&header, sizeof(header) });
+        if(!table.empty()) {
+            iov.push_back(iovec { (void*)table.data(), table.size() });
         }
-        return false;
+        if(stride == (std::ptrdiff_t)(row + pad) && !top_down) {
+            iov.push_back(iovec { pixels, (row + pad) * height });
+        } else {
+            iov.reserve(iov.size() + height * 2);
+            for(unsigned int i = 0; i < height; ++i) {
+                const unsigned int y = top_down ? height - 1 - i : i;
+                iov.push_back(iovec { rowAt(y), row });
+                if(pad != 0) {
+                    iov.push_back(iovec { (void*)padding, pad });
+                }
+            }
+        }
+
+        try {
+            bmp_detail::writeAll(fd, iov);
+        } catch(...) {
+            ::close(fd);
+            throw;
+        }
+        if(::close(fd) != 0) {
+            return false;
+        }
+        return path == file_name || std::rename(path.c_str(), file_name.c_str()) == 0;
+    }
+
+    // Stores the rows top to bottom in the file. The image itself is the same.
+    void setTopDown(bool _top_down)
+    {
+        top_down = _top_down;
     }
 
     unsigned char* getPixels()
     {
+        require();
         return pixels;
     }
 
+    std::ptrdiff_t getStride() const
+    {
+        return stride;
+    }
+
+    unsigned int getWidth() const
+    {
+        return width;
+    }
+
+    unsigned int getHeight() const
+    {
+        return height;
+    }
+
+    unsigned int getBpp() const
+    {
+        return bpp;
+    }
+
     void setPixel(unsigned int x, unsigned int y, unsigned char r, unsigned char g, unsigned char b)
     {
-        if(pixels == nullptr) {
-            throw std::runtime_error("Pixel buffer must be set by calling setSize or the BMP constructor.");
-        }
+        require();
 
-        if(x >= 0 && y >= 0 && x < width && y < height) {
-            pixels[(y * width + x) * 3 + 2] = r;
-            pixels[(y * width + x) * 3 + 1] = g;
-            pixels[(y * width + x) * 3 + 0] = b;
-        }
+        plot(x, y, pack(r, g, b), bounds());
     }
 
     Pixel getPixel(unsigned int x, unsigned int y)
     {
-        if(pixels == nullptr) {
-            throw std::runtime_error("Pixel buffer must be set by calling setSize or the BMP constructor.");
-        }
+        require();
 
-        if(x >= 0 && y >= 0 && x < width && y < height && pixels != nullptr) {
-            return Pixel(pixels[(y * width + x) * 3 + 2], pixels[(y * width + x) * 3 + 1], pixels[(y * width + x) * 3 + 0]);
+        if(x < width && y < height) {
+            return unpack(rowAt(y) + (std::size_t)x * pixelSize());
         }
         return Pixel();
     }
 
     void fill(unsigned char value = 0)
     {
-        if(pixels == nullptr) {
-            throw std::runtime_error("Pixel buffer must be set by calling setSize or the BMP constructor.");
-        }
+        require();
 
-        for(int i = 0; i < width * height * (bpp / 8); ++i) {
-            pixels[i] = value;
+        if(stride == (std::ptrdiff_t)width * pixelSize()) {
+            std::memset(pixels, value, dataSize());
+            return;
+        }
+        for(unsigned int y = 0; y < height; ++y) {
+            std::memset(rowAt(y), value, (std::size_t)width * pixelSize());
         }
     }
 
+    // Filled circles cover the pixels strictly inside the radius, one span per
+    // row. Outlines are traced with the integer midpoint algorithm.
     void circle(unsigned int x, unsigned int y, unsigned int radius, unsigned char r, unsigned char g, unsigned char b, bool fill)
     {
-        if(pixels == nullptr) {
-            throw std::runtime_error("Pixel buffer must be set by calling setSize or the BMP constructor.");
+        require();
+
+        drawCircle(x, y, radius, pack(r, g, b), fill, bounds());
+    }
+
+    void line(unsigned int x, unsigned int y, unsigned int x2, unsigned int y2, unsigned char r, unsigned char g, unsigned char b)
+    {
+        require();
+
+        bresenham(x, y, x2, y2, pack(r, g, b), bounds());
+    }
+
+    // Draws distance pixels from (x, y) in the direction of angle, in radians.
+    void lineAD(unsigned int x, unsigned int y, float angle, unsigned int distance, unsigned char r, unsigned char g, unsigned char b)
+    {
+        require();
+
+        if(distance == 0) { return; }
+        long long x2, y2;
+        lineEnd(x, y, angle, distance, x2, y2);
+        bresenham(x, y, x2, y2, pack(r, g, b), bounds());
+    }
+
+    void square(unsigned int x, unsigned int y, unsigned int _width, unsigned int _height, unsigned char r, unsigned char g, unsigned b, bool fill)
+    {
+        require();
+
+        drawSquare(x, y, (long long)x + _width, (long long)y + _height, pack(r, g, b), fill, bounds());
+    }
+
+    // Records draw calls for draw(), which rasterizes them on many threads with
+    // the same result as making the calls on the image in order.
+    class Batch
+    {
+    public:
+        void setPixel(unsigned int x, unsigned int y, unsigned char r, unsigned char g, unsigned char b)
+        {
+            commands.push_back(Command { Shape::PIXEL, x, y, x, y, r, g, b, false });
         }
 
-        unsigned int new_x = 0, new_y = 0;
-        for(int _y = y - radius; _y <= y + radius; ++_y) {
-            for(int _x = x - radius; _x <= x + radius; ++_x) {
-                if(_x >= 0 && _y >= 0 && _x < width && _y < height) {
-                    float distance = std::sqrt((_x - x) * (_x - x) + (_y - y) * (_y - y));
-                    if(fill) {
-                        if(distance < radius) {
-                            pixels[(_y * width + _x) * 3 + 2] = r;
-                            pixels[(_y * width + _x) * 3 + 1] = g;
-                            pixels[(_y * width + _x) * 3 + 0] = b;
-                        }
-                    } else {
-                        if(std::abs(distance - (float)radius) < 0.5f) {
-                            pixels[(_y * width + _x) * 3 + 2] = r;
-                            pixels[(_y * width + _x) * 3 + 1] = g;
-                            pixels[(_y * width + _x) * 3 + 0] = b;
-                        }
+        void circle(unsigned int x, unsigned int y, unsigned int radius, unsigned char r, unsigned char g, unsigned char b, bool fill)
+        {
+            commands.push_back(Command { Shape::CIRCLE, x, y, radius, 0, r, g, b, fill });
+        }
+
+        void line(unsigned int x, unsigned int y, unsigned int x2, unsigned int y2, unsigned char r, unsigned char g, unsigned char b)
+        {
+            commands.push_back(Command { Shape::LINE, x, y, x2, y2, r, g, b, false });
+        }
+
+        void lineAD(unsigned int x, unsigned int y, float angle, unsigned int distance, unsigned char r, unsigned char g, unsigned char b)
+        {
+            if(distance == 0) { return; }
+            long long x2, y2;
+            lineEnd(x, y, angle, distance, x2, y2);
+            commands.push_back(Command { Shape::LINE, x, y, x2, y2, r, g, b, false });
+        }
+
+        void square(unsigned int x, unsigned int y, unsigned int _width, unsigned int _height, unsigned char r, unsigned char g, unsigned b, bool fill)
+        {
+            commands.push_back(Command { Shape::SQUARE, x, y, (long long)x + _width, (long long)y + _height, r, g, (unsigned char)b, fill });
+        }
+
+        void clear()
+        {
+            commands.clear();
+        }
+
+        std::size_t size() const
+        {
+            return commands.size();
+        }
+
+    private:
+        friend class BMP;
+
+        enum class Shape
+        {
+            PIXEL = 0,
+            LINE,
+            CIRCLE,
+            SQUARE
+        };
+
+        // Circles keep their radius in x2.
+        struct Command
+        {
+            Shape shape;
+            long long x, y, x2, y2;
+            unsigned char r, g, b;
+            bool fill;
+        };
+
+        std::vector<Command> commands;
+    };
+
+    // Bins the batch's commands into tiles of tile_size pixels squared and
+    // rasterizes the tiles on threads workers, every hardware thread by
+    // default. A tile belongs to one worker, which applies its commands in the
+    // order they were recorded, so no locks are needed and the image comes out
+    // exactly as if the commands had been drawn one by one.
+    void draw(const Batch& batch, unsigned int threads = 0)
+    {
+        require();
+
+        const unsigned int tiles_x = (width + tile_size - 1) / tile_size;
+        const unsigned int tiles_y = (height + tile_size - 1) / tile_size;
+        std::vector<std::vector<std::uint32_t>> bins((std::size_t)tiles_x * tiles_y);
+        std::vector<Pattern> patterns;
+        patterns.reserve(batch.commands.size());
+
+        for(std::uint32_t i = 0; i < batch.commands.size(); ++i) {
+            const Batch::Command& command = batch.commands[i];
+            patterns.push_back(pack(command.r, command.g, command.b));
+
+            // Slanted lines only go to the tiles they cross, not to every
+            // tile of their bounding box
+            if(command.shape == Batch::Shape::LINE && command.y != command.y2) {
+                binLine(command, i, tiles_x, bins);
+                continue;
+            }
+
+            Clip box = extent(command);
+            box.x0 = std::max(box.x0, 0LL);
+            box.y0 = std::max(box.y0, 0LL);
+            box.x1 = std::min(box.x1, (long long)width);
+            box.y1 = std::min(box.y1, (long long)height);
+            if(box.x0 >= box.x1 || box.y0 >= box.y1) { continue; }
+
+            for(long long ty = box.y0 / tile_size; ty <= (box.y1 - 1) / tile_size; ++ty) {
+                for(long long tx = box.x0 / tile_size; tx <= (box.x1 - 1) / tile_size; ++tx) {
+                    const std::size_t tile = ty * tiles_x + tx;
+                    if(touches(command, tileClip(tile, tiles_x))) {
+                        bins[tile].push_back(i);
                     }
                 }
-            }   
+            }
+        }
+
+        if(threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
         }
+        threads = std::max<std::size_t>(1, std::min<std::size_t>(threads, bins.size()));
+
+        std::atomic<std::size_t> next { 0 };
+        bmp_detail::parallelFor(threads, [&](unsigned int) {
+            for(std::size_t tile = next++; tile < bins.size(); tile = next++) {
+                const Clip clip = tileClip(tile, tiles_x);
+                for(std::uint32_t i : bins[tile]) {
+                    render(batch.commands[i], patterns[i], clip);
+                }
+            }
+        });
     }
 
-    void line(unsigned int x, unsigned int y, unsigned int x2, unsigned int y2, unsigned char r, unsigned char g, unsigned char b)
+    unsigned int dataSize() const
     {
-        if(pixels == nullptr) {
-            throw std::runtime_error("Pixel buffer must be set by calling setSize or the BMP constructor.");
+        return width * height * pixelSize();
+    }
+
+    BMP(const BMP& other)
+    {
+        copyFrom(other);
+    }
+
+    BMP& operator=(const BMP& other)
+    {
+        if(this != &other) {
+            copyFrom(other);
         }
+        return *this;
+    }
 
-        float angle = std::atan2(y2 - y, x2 - x);
-        float distance= std::sqrt((x2 - x) * (x2 - x) + (y2 - y) * (y2 - y));
-        unsigned int _x = 0;
-        unsigned int _y = 0;
-        for(int i = 0; i < std::ceil(distance); ++i) {
-            _x = cos(angle) * i + x;
-            _y = sin(angle) * i + y;
-            if(_x >= 0 && _y >= 0 && _x < width && _y < height) {
-                pixels[(_y * width + _x) * 3 + 2] = r;
-                pixels[(_y * width + _x) * 3 + 1] = g;
-                pixels[(_y * width + _x) * 3 + 0] = b;
-            }
+    BMP(BMP&& other) noexcept
+    {
+        moveFrom(other);
+    }
+
+    BMP& operator=(BMP&& other) noexcept
+    {
+        if(this != &other) {
+            release();
+            moveFrom(other);
         }
+        return *this;
     }
 
-    void lineAD(unsigned int x, unsigned int y, float angle, unsigned int distance, unsigned char r, unsigned char g, unsigned char b)
+    ~BMP()
     {
-        unsigned int _x = 0;
-        unsigned int _y = 0;
-        for(int i = 0; i < distance; ++i) {
-            _x = cos(angle) * i + x;
-            _y = sin(angle) * i + y;
-            if(_x >= 0 && _y >= 0 && _x < width && _y < height) {
-                pixels[(_y * width + _x) * 3 + 2] = r;
-                pixels[(_y * width + _x) * 3 + 1] = g;
-                pixels[(_y * width + _x) * 3 + 0] = b;
-            }
+        release();
+    }
+
+private:
+    // A colour as it is laid out in memory for the current depth, B, G, R.
+    struct Pattern
+    {
+        unsigned char bytes[4];
+    };
+
+    unsigned int pixelSize() const
+    {
+        return bpp / 8;
+    }
+
+    Pattern pack(unsigned char r, unsigned char g, unsigned char b) const
+    {
+        if(bpp == 8) {
+            return Pattern { { (unsigned char)((r & 0xE0) | ((g >> 3) & 0x1C) | (b >> 6)), 0, 0, 0 } };
+        }
+        if(bpp == 16) {
+            const std::uint16_t value = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            return Pattern { { (unsigned char)value, (unsigned char)(value >> 8), 0, 0 } };
         }
+        return Pattern { { b, g, r, 0 } };
     }
 
-    void square(unsigned int x, unsigned int y, unsigned int _width, unsigned int _height, unsigned char r, unsigned char g, unsigned b, bool fill)
+    Pixel unpack(const unsigned char* pixel) const
     {
+        if(bpp == 8) {
+            return Pixel((*pixel >> 5) * 255 / 7, ((*pixel >> 2) & 7) * 255 / 7, (*pixel & 3) * 255 / 3);
+        }
+        if(bpp == 16) {
+            const unsigned int value = pixel[0] | (pixel[1] << 8);
+            return Pixel((value >> 11) * 255 / 31, ((value >> 5) & 63) * 255 / 63, (value & 31) * 255 / 31);
+        }
+        return Pixel(pixel[2], pixel[1], pixel[0]);
+    }
+
+    // Pixels of a file that BMP cannot use as they are, left in the mapping
+    // until something needs them.
+    struct Source
+    {
+        const unsigned char* bits { nullptr };
+        std::ptrdiff_t stride { 0 };
+        unsigned short bpp { 0 };
+        std::uint32_t masks[3] { 0, 0, 0 };
+        std::vector<unsigned char> palette;
+    };
+
+    void require()
+    {
+        if(pixels == nullptr && source.bits != nullptr) {
+            convert();
+        }
         if(pixels == nullptr) {
             throw std::runtime_error("Pixel buffer must be set by calling setSize or the BMP constructor.");
         }
+    }
+
+    unsigned char* rowAt(long long y) const
+    {
+        return pixels + y * stride;
+    }
+
+    // Validates the mapped file and either points pixels into it or records
+    // where the pixels are for convert().
+    void attach()
+    {
+        using bmp_detail::get32;
+        const unsigned char* data = mapping;
+        auto invalid = [this](const std::string& reason) {
+            return std::runtime_error(file_name + " is not a valid bitmap: " + reason + ".");
+        };
+
+        if(data[0] != 'B' || data[1] != 'M') { throw invalid("the BM signature is missing"); }
+        const std::uint32_t info_size = get32(data + 14);
+        const std::int32_t file_width = (std::int32_t)get32(data + 18);
+        const std::int32_t file_height = (std::int32_t)get32(data + 22);
+        const unsigned int file_bpp = data[28] | (data[29] << 8);
+        const std::uint32_t compression = get32(data + 30);
+        const std::uint32_t offset = get32(data + 10);
+
+        if(info_size < 40 || info_size > mapping_size - 14) { throw invalid("the info header is not supported"); }
+        if(file_width <= 0 || file_height == 0 || file_height == INT32_MIN) { throw invalid("the dimensions are out of range"); }
+        if(file_bpp != 1 && file_bpp != 4 && file_bpp != 8 && file_bpp != 16 && file_bpp != 24 && file_bpp != 32) {
+            throw invalid("the bit depth is not supported");
+        }
+        if(compression != 0 && !(compression == 3 && (file_bpp == 16 || file_bpp == 32))) {
+            throw invalid("the compression is not supported");
+        }
 
-        unsigned int new_x = 0, new_y = 0;
-        for(int _y = y; _y <= y + _height; ++_y) {
-            for(int _x = x; _x <= x + _width; ++_x) {
-                if(_x >= 0 && _y >= 0 && _x < width && _y < height) {
-                    if(fill) {
-                        pixels[(_y * width + _x) * 3 + 2] = r;
-                        pixels[(_y * width + _x) * 3 + 1] = g;
-                        pixels[(_y * width + _x) * 3 + 0] = b;
+        width = file_width;
+        height = file_height < 0 ? -(std::int64_t)file_height : file_height;
+        top_down = file_height < 0;
+        const std::size_t file_row = bmp_detail::rowSize(width, file_bpp);
+        if(offset > mapping_size || file_row * height > mapping_size - offset) { throw invalid("the pixel data is truncated"); }
+
+        source = Source();
+        source.bpp = file_bpp;
+        source.bits = data + offset + (top_down ? (height - 1) * file_row : 0);
+        source.stride = top_down ? -(std::ptrdiff_t)file_row : (std::ptrdiff_t)file_row;
+
+        bool native = file_bpp == 24;
+        if(file_bpp == 16 || file_bpp == 32) {
+            if(compression == 3) {
+                if(14 + 40 + 12 > mapping_size) { throw invalid("the channel masks are truncated"); }
+                for(int i = 0; i < 3; ++i) {
+                    source.masks[i] = get32(data + 54 + i * 4);
+                }
+            } else {
+                source.masks[0] = file_bpp == 16 ? 0x7C00 : 0x00FF0000;
+                source.masks[1] = file_bpp == 16 ? 0x03E0 : 0x0000FF00;
+                source.masks[2] = file_bpp == 16 ? 0x001F : 0x000000FF;
+            }
+            const std::vector<unsigned char> ours = bmp_detail::colorTable(file_bpp);
+            native = get32(&ours[0]) == source.masks[0] && get32(&ours[4]) == source.masks[1] && get32(&ours[8]) == source.masks[2];
+        } else if(file_bpp <= 8) {
+            const std::uint32_t used = get32(data + 46);
+            const std::size_t entries = used != 0 ? used : (1u << file_bpp);
+            const std::size_t table = 14 + info_size;
+            if(entries > (1u << file_bpp) || table + entries * 4 > offset) { throw invalid("the palette is out of range"); }
+            source.palette.assign(data + table, data + table + entries * 4);
+
+            if(file_bpp == 8 && entries == 256) {
+                const std::vector<unsigned char> ours = bmp_detail::colorTable(8);
+                native = true;
+                for(std::size_t i = 0; i < entries && native; ++i) {
+                    native = std::memcmp(&ours[i * 4], &source.palette[i * 4], 3) == 0;
+                }
+            }
+        }
+
+        if(native) {
+            bpp = file_bpp;
+            pixels = const_cast<unsigned char*>(source.bits);
+            stride = source.stride;
+            source = Source();
+        } else {
+            bpp = 24;
+            stride = (std::ptrdiff_t)width * 3;
+        }
+    }
+
+    // Decodes the recorded source into packed 24 bpp rows at out.
+    void decode(unsigned char* out) const
+    {
+        int shift[3] { 0, 0, 0 };
+        std::uint32_t top[3] { 0, 0, 0 };
+        for(int i = 0; i < 3; ++i) {
+            if(source.masks[i] != 0) {
+                shift[i] = __builtin_ctz(source.masks[i]);
+                top[i] = source.masks[i] >> shift[i];
+            }
+        }
+
+        const unsigned int entries = source.palette.size() / 4;
+        for(unsigned int y = 0; y < height; ++y) {
+            const unsigned char* in = source.bits + (std::ptrdiff_t)y * source.stride;
+            for(unsigned int x = 0; x < width; ++x, out += 3) {
+                if(source.bpp <= 8) {
+                    const std::size_t bit = (std::size_t)x * source.bpp;
+                    const unsigned int index = (in[bit / 8] >> (8 - source.bpp - bit % 8)) & ((1u << source.bpp) - 1);
+                    if(index < entries) {
+                        std::memcpy(out, &source.palette[index * 4], 3);
                     } else {
-                        if(_x == x || _x == x + _width || _y == y || _y == y + _height)
-                        {
-                            pixels[(_y * width + _x) * 3 + 2] = r;
-                            pixels[(_y * width + _x) * 3 + 1] = g;
-                            pixels[(_y * width + _x) * 3 + 0] = b;
-                        }
+                        std::memset(out, 0, 3);
                     }
+                    continue;
                 }
-            }   
+
+                std::uint32_t value = source.bpp == 16 ? in[x * 2] | (in[x * 2 + 1] << 8) : bmp_detail::get32(in + x * 4);
+                for(int i = 0; i < 3; ++i) {
+                    out[2 - i] = top[i] == 0 ? 0 : (unsigned char)(((value >> shift[i]) & top[i]) * 255 / top[i]);
+                }
+            }
         }
     }
 
-    const unsigned int dataSize() const
+    void convert()
     {
-        return width * height * (bpp / 8);
+        const std::size_t bytes = (std::size_t)width * height * 3;
+        unsigned char* converted = bmp_detail::allocate(bytes);
+        decode(converted);
+        ::munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+        source = Source();
+        pixels = converted;
+        capacity = bytes;
     }
 
-    BMP(const BMP& other)
+    // Frees the buffer or unmaps the file, whichever backs the pixels.
+    void release()
     {
-        pixels = new unsigned char[other.dataSize()];
-        memcpy(pixels, other.pixels, other.dataSize());
-        width = other.width;
-        height = other.height;
-        bpp = other.bpp;
-        file_name = other.file_name;
-        header = other.header;
+        if(mapping != nullptr) {
+            ::munmap(mapping, mapping_size);
+        } else {
+            bmp_detail::deallocate(pixels);
+        }
+        pixels = nullptr;
+        capacity = 0;
+        mapping = nullptr;
+        mapping_size = 0;
+        source = Source();
     }
 
-    void operator=(const BMP& other)
+    // Makes pixels an owned buffer of at least bytes, reusing the current one
+    // when it is big enough. The contents are not kept.
+    void reserve(std::size_t bytes)
     {
-        pixels = new unsigned char[other.dataSize()];
-        memcpy(pixels, other.pixels, other.dataSize());
-        width = other.width;
-        height = other.height;
-        bpp = other.bpp;
-        file_name = other.file_name;
-        header = other.header;   
+        if(mapping != nullptr || (pixels != nullptr && capacity < bytes)) {
+            release();
+        }
+        if(pixels == nullptr) {
+            pixels = bmp_detail::allocate(bytes);
+            capacity = bytes;
+        }
     }
 
-    BMP(BMP&& other)
+    // Copies into a packed buffer of the copy's own, decoding if need be.
+    void copyFrom(const BMP& other)
     {
-        pixels = other.pixels;
-        other.pixels = nullptr;
         width = other.width;
         height = other.height;
         bpp = other.bpp;
         file_name = other.file_name;
-        header = other.header;
+        top_down = other.top_down;
+        stride = (std::ptrdiff_t)width * pixelSize();
+        if(other.pixels == nullptr && other.source.bits == nullptr) {
+            release();
+            return;
+        }
+
+        reserve(dataSize());
+        if(other.pixels == nullptr) {
+            other.decode(pixels);
+        } else {
+            for(unsigned int y = 0; y < height; ++y) {
+                std::memcpy(rowAt(y), other.rowAt(y), stride);
+            }
+        }
     }
 
-    void operator=(BMP&& other)
+    // Leaves other empty, with no pixels and a size of zero.
+    void moveFrom(BMP& other) noexcept
     {
         pixels = other.pixels;
-        other.pixels = nullptr;
+        capacity = other.capacity;
+        mapping = other.mapping;
+        mapping_size = other.mapping_size;
+        source = std::move(other.source);
         width = other.width;
         height = other.height;
         bpp = other.bpp;
-        file_name = other.file_name;
-        header = other.header;
+        stride = other.stride;
+        file_name = std::move(other.file_name);
+        top_down = other.top_down;
+
+        other.pixels = nullptr;
+        other.capacity = 0;
+        other.mapping = nullptr;
+        other.mapping_size = 0;
+        other.source = Source();
+        other.width = 0;
+        other.height = 0;
+        other.stride = 0;
     }
 
-    ~BMP()
+    static void validate(const std::string& _file_name, unsigned int _width, unsigned int _height, unsigned int _bpp)
     {
-        delete[] pixels;
+        if(_file_name == "") {
+            throw std::invalid_argument("File name cannot be blank.");
+        }
+
+        if(_width == 0 || _height == 0) {
+            throw std::invalid_argument("Width and Height cannot be equal to zero.");
+        }
+
+        if(_bpp != 8 && _bpp != 16 && _bpp != 24 && _bpp != 32) {
+            throw std::invalid_argument("Bits per pixel must be 8, 16, 24, or 32.");
+        }
     }
 
-private:
+    // Used by BMPPool to build a frame around a recycled buffer.
+    BMP(const std::string& _file_name, unsigned int _width, unsigned int _height, unsigned int _bpp, unsigned char* buffer, std::size_t _capacity) : pixels(buffer), width(_width), height(_height), bpp(_bpp), file_name(_file_name), capacity(_capacity)
+    {
+        stride = (std::ptrdiff_t)width * pixelSize();
+    }
+
+    // Hands an owned buffer over to BMPPool and leaves the image empty.
+    // Returns false, after unmapping, for an image without one.
+    bool detach(unsigned char*& buffer, std::size_t& _capacity)
+    {
+        if(mapping != nullptr || pixels == nullptr) {
+            release();
+            return false;
+        }
+        buffer = pixels;
+        _capacity = capacity;
+        pixels = nullptr;
+        capacity = 0;
+        width = 0;
+        height = 0;
+        stride = 0;
+        return true;
+    }
+
+    friend class BMPPool;
+
+    // The rectangle [x0, x1) x [y0, y1) that drawing may touch.
+    struct Clip
+    {
+        long long x0, y0, x1, y1;
+    };
+
+    Clip bounds() const
+    {
+        return Clip { 0, 0, width, height };
+    }
+
+    Clip tileClip(std::size_t tile, unsigned int tiles_x) const
+    {
+        const long long x = (long long)(tile % tiles_x) * tile_size, y = (long long)(tile / tiles_x) * tile_size;
+        return Clip { x, y, std::min<long long>(x + tile_size, width), std::min<long long>(y + tile_size, height) };
+    }
+
+    // Bounding box of the pixels a command can draw.
+    static Clip extent(const Batch::Command& command)
+    {
+        if(command.shape == Batch::Shape::CIRCLE) {
+            return Clip { command.x - command.x2, command.y - command.x2, command.x + command.x2 + 1, command.y + command.x2 + 1 };
+        }
+        return Clip { std::min(command.x, command.x2), std::min(command.y, command.y2), std::max(command.x, command.x2) + 1, std::max(command.y, command.y2) + 1 };
+    }
+
+    // Whether an outline can reach the tile at all, so that large outlines are
+    // not walked for every tile inside them.
+    static bool touches(const Batch::Command& command, const Clip& tile)
+    {
+        if(command.fill) { return true; }
+        if(command.shape == Batch::Shape::SQUARE) {
+            return !(tile.x0 > command.x && tile.x1 - 1 < command.x2 && tile.y0 > command.y && tile.y1 - 1 < command.y2);
+        }
+        if(command.shape == Batch::Shape::CIRCLE) {
+            // Midpoint circle pixels lie strictly between radius - 1 and
+            // radius + 1 from the centre.
+            const long long radius = command.x2;
+            const long long near_x = std::max({ tile.x0 - command.x, command.x - (tile.x1 - 1), 0LL });
+            const long long near_y = std::max({ tile.y0 - command.y, command.y - (tile.y1 - 1), 0LL });
+            const long long far_x = std::max(std::llabs(tile.x0 - command.x), std::llabs(tile.x1 - 1 - command.x));
+            const long long far_y = std::max(std::llabs(tile.y0 - command.y), std::llabs(tile.y1 - 1 - command.y));
+            return near_x * near_x + near_y * near_y < (radius + 1) * (radius + 1) &&
+                (radius < 1 || far_x * far_x + far_y * far_y > (radius - 1) * (radius - 1));
+        }
+        return true;
+    }
+
+    // Adds command i to the bin of every tile that one of its pixels falls in,
+    // one run of steps per tile along the line's longer axis.
+    void binLine(const Batch::Command& command, std::uint32_t i, unsigned int tiles_x, std::vector<std::vector<std::uint32_t>>& bins) const
+    {
+        const LineWalk line(command.x, command.y, command.x2, command.y2);
+        long long k, last;
+        line.range(bounds(), k, last);
+        while(k <= last) {
+            const long long major = line.major + line.major_step * k;
+            const long long band = major / tile_size;
+            const long long end = std::min(last, line.major_step > 0 ? (band + 1) * tile_size - 1 - line.major : line.major - band * tile_size);
+            const long long minor = line.minor + line.minor_step * line.offset(k);
+            const long long minor_end = line.minor + line.minor_step * line.offset(end);
+            for(long long t = std::min(minor, minor_end) / tile_size; t <= std::max(minor, minor_end) / tile_size; ++t) {
+                bins[line.x_major ? t * tiles_x + band : band * tiles_x + t].push_back(i);
+            }
+            k = end + 1;
+        }
+    }
+
+    void render(const Batch::Command& command, const Pattern& pattern, const Clip& clip)
+    {
+        switch(command.shape) {
+            case Batch::Shape::PIXEL:
+                plot(command.x, command.y, pattern, clip);
+                break;
+            case Batch::Shape::LINE:
+                bresenham(command.x, command.y, command.x2, command.y2, pattern, clip);
+                break;
+            case Batch::Shape::CIRCLE:
+                drawCircle(command.x, command.y, command.x2, pattern, command.fill, clip);
+                break;
+            case Batch::Shape::SQUARE:
+                drawSquare(command.x, command.y, command.x2, command.y2, pattern, command.fill, clip);
+                break;
+        }
+    }
+
+    static void lineEnd(unsigned int x, unsigned int y, float angle, unsigned int distance, long long& x2, long long& y2)
+    {
+        x2 = std::llround(x + std::cos(angle) * (distance - 1.0));
+        y2 = std::llround(y + std::sin(angle) * (distance - 1.0));
+    }
+
+    void plot(long long x, long long y, const Pattern& pattern, const Clip& clip)
+    {
+        if(x >= clip.x0 && y >= clip.y0 && x < clip.x1 && y < clip.y1) {
+            std::memcpy(rowAt(y) + x * pixelSize(), pattern.bytes, pixelSize());
+        }
+    }
+
+    // Fills row y from x to x2 inclusive, clipped. The colour is repeated into
+    // 48 bytes, a whole number of pixels at every depth and of 16 byte vectors,
+    // and stored a block at a time.
+    void span(long long x, long long x2, long long y, const Pattern& pattern, const Clip& clip)
+    {
+        if(y < clip.y0 || y >= clip.y1) { return; }
+        x = std::max(x, clip.x0);
+        x2 = std::min(x2, clip.x1 - 1);
+        if(x > x2) { return; }
+
+        const std::size_t size = pixelSize();
+        unsigned char* out = rowAt(y) + x * size;
+        std::size_t bytes = (std::size_t)(x2 - x + 1) * size;
+
+        alignas(16) unsigned char block[48];
+        for(std::size_t i = 0; i < sizeof(block); i += size) {
+            std::memcpy(block + i, pattern.bytes, size);
+        }
+
+#if defined(__SSE2__)
+        const __m128i v0 = _mm_load_si128((const __m128i*)block);
+        const __m128i v1 = _mm_load_si128((const __m128i*)(block + 16));
+        const __m128i v2 = _mm_load_si128((const __m128i*)(block + 32));
+        for(; bytes >= sizeof(block); bytes -= sizeof(block), out += sizeof(block)) {
+            _mm_storeu_si128((__m128i*)out, v0);
+            _mm_storeu_si128((__m128i*)(out + 16), v1);
+            _mm_storeu_si128((__m128i*)(out + 32), v2);
+        }
+#else
+        for(; bytes >= sizeof(block); bytes -= sizeof(block), out += sizeof(block)) {
+            std::memcpy(out, block, sizeof(block));
+        }
+#endif
+        std::memcpy(out, block, bytes);
+    }
+
+    // A Bresenham line in closed form. Step k moves k pixels along the longer
+    // axis and offset(k), k * rise / steps rounded half up, along the other,
+    // which are the pixels the integer walk visits. So a clip can jump to the
+    // first step inside it instead of walking there.
+    struct LineWalk
+    {
+        bool x_major;
+        long long major, minor;           // Start on each axis
+        long long major_step, minor_step; // 1 or -1
+        long long steps, rise;            // Length on each axis
+
+        LineWalk(long long x, long long y, long long x2, long long y2)
+        {
+            const long long dx = std::llabs(x2 - x), dy = std::llabs(y2 - y);
+            x_major = dx >= dy;
+            major = x_major ? x : y;
+            minor = x_major ? y : x;
+            major_step = (x_major ? x2 - x : y2 - y) < 0 ? -1 : 1;
+            minor_step = (x_major ? y2 - y : x2 - x) < 0 ? -1 : 1;
+            steps = std::max(dx, dy);
+            rise = std::min(dx, dy);
+        }
+
+        // The products reach past 64 bits for lines near the coordinate limits.
+        long long offset(long long k) const
+        {
+            return steps == 0 ? 0 : (long long)(((__int128)2 * k * rise + steps) / (2 * (__int128)steps));
+        }
+
+        // Smallest step whose offset is at least t, or steps + 1 if none is.
+        long long firstReaching(long long t) const
+        {
+            if(t <= 0) { return 0; }
+            if(rise == 0) { return steps + 1; }
+            const __int128 n = (__int128)2 * steps * t - steps, d = (__int128)2 * rise;
+            return (long long)std::min<__int128>((n + d - 1) / d, steps + 1);
+        }
+
+        // Steps first to last are the ones inside clip. The major axis moves
+        // one pixel a step and the offset never decreases, so each bound of
+        // the clip cuts off a run at the start or the end.
+        void range(const Clip& clip, long long& first, long long& last) const
+        {
+            const long long lo = x_major ? clip.x0 : clip.y0, hi = (x_major ? clip.x1 : clip.y1) - 1;
+            const long long minor_lo = x_major ? clip.y0 : clip.x0, minor_hi = (x_major ? clip.y1 : clip.x1) - 1;
+            first = std::max(0LL, major_step > 0 ? lo - major : major - hi);
+            last = std::min(steps, major_step > 0 ? hi - major : major - lo);
+            first = std::max(first, firstReaching(minor_step > 0 ? minor_lo - minor : minor - minor_hi));
+            last = std::min(last, firstReaching((minor_step > 0 ? minor_hi - minor : minor - minor_lo) + 1) - 1);
+        }
+    };
+
+    // Integer line from (x, y) to (x2, y2), both ends included, drawn only
+    // over the steps inside clip. Horizontal lines go through span.
+    void bresenham(long long x, long long y, long long x2, long long y2, const Pattern& pattern, const Clip& clip)
+    {
+        if(y == y2) {
+            span(std::min(x, x2), std::max(x, x2), y, pattern, clip);
+            return;
+        }
+
+        const LineWalk line(x, y, x2, y2);
+        long long k, last;
+        line.range(clip, k, last);
+        if(k > last) { return; }
+
+        // The offset as a quotient and a remainder of 2 * steps, so that each
+        // step only adds 2 * rise to the remainder
+        const long long twice = 2 * line.steps;
+        const __int128 start = (__int128)2 * k * line.rise + line.steps;
+        long long remainder = (long long)(start % twice);
+        long long major = line.major + line.major_step * k;
+        long long minor = line.minor + line.minor_step * (long long)(start / twice);
+        for(; k <= last; ++k) {
+            if(line.x_major) {
+                plot(major, minor, pattern, clip);
+            } else {
+                plot(minor, major, pattern, clip);
+            }
+            major += line.major_step;
+            remainder += 2 * line.rise;
+            if(remainder >= twice) {
+                remainder -= twice;
+                minor += line.minor_step;
+            }
+        }
+    }
+
+    void drawCircle(long long cx, long long cy, long long radius, const Pattern& pattern, bool fill, const Clip& clip)
+    {
+        if(fill) {
+            // Widest half-span with dx * dx + dy * dy < radius * radius.
+            const long long radius_sq = radius * radius;
+            for(long long y = std::max(cy - radius + 1, clip.y0); y <= std::min(cy + radius - 1, clip.y1 - 1); ++y) {
+                const long long limit = radius_sq - (y - cy) * (y - cy) - 1;
+                long long half = (long long)std::sqrt((double)limit);
+                while(half * half > limit) { --half; }
+                while((half + 1) * (half + 1) <= limit) { ++half; }
+                span(cx - half, cx + half, y, pattern, clip);
+            }
+            return;
+        }
+
+        long long dx = radius, dy = 0, error = 1 - dx;
+        while(dx >= dy) {
+            plot(cx + dx, cy + dy, pattern, clip);
+            plot(cx - dx, cy + dy, pattern, clip);
+            plot(cx + dx, cy - dy, pattern, clip);
+            plot(cx - dx, cy - dy, pattern, clip);
+            plot(cx + dy, cy + dx, pattern, clip);
+            plot(cx - dy, cy + dx, pattern, clip);
+            plot(cx + dy, cy - dx, pattern, clip);
+            plot(cx - dy, cy - dx, pattern, clip);
+
+            ++dy;
+            if(error < 0) {
+                error += 2 * dy + 1;
+            } else {
+                --dx;
+                error += 2 * (dy - dx) + 1;
+            }
+        }
+    }
+
+    void drawSquare(long long x, long long y, long long x2, long long y2, const Pattern& pattern, bool fill, const Clip& clip)
+    {
+        if(fill) {
+            for(long long _y = std::max(y, clip.y0); _y <= std::min(y2, clip.y1 - 1); ++_y) {
+                span(x, x2, _y, pattern, clip);
+            }
+            return;
+        }
+
+        span(x, x2, y, pattern, clip);
+        span(x, x2, y2, pattern, clip);
+        for(long long _y = std::max(y + 1, clip.y0); _y < std::min(y2, clip.y1); ++_y) {
+            plot(x, _y, pattern, clip);
+            plot(x2, _y, pattern, clip);
+        }
+    }
+
+    static constexpr unsigned int tile_size { 64 };
+
     unsigned char* pixels   { nullptr };
     unsigned int width      { 100 };
     unsigned int height     { 100 };
     unsigned short bpp      { 24 };
     std::string file_name   { "_img.bmp" };
-    BMPFILEHEADER header;
+    bool top_down           { false };
+    std::ptrdiff_t stride   { 0 };
+    std::size_t capacity    { 0 };
+    unsigned char* mapping  { nullptr };
+    std::size_t mapping_size{ 0 };
+    Source source;
+};
+
+// Streams a bitmap to disk a row at a time, so an image never has to fit in
+// memory. Rows are given in the pixel format described above BMP and in file
+// order: bottom first, or top first when top_down is set.
+class BMPWriter
+{
+public:
+    BMPWriter(const std::string& file_name, unsigned int _width, unsigned int _height, unsigned int _bpp = 24, bool top_down = false, std::size_t buffer_size = 1 << 20) : height(_height)
+    {
+        if(_width == 0 || _height == 0) {
+            throw std::invalid_argument("Width and Height cannot be equal to zero.");
+        }
+
+        if(_bpp != 8 && _bpp != 16 && _bpp != 24 && _bpp != 32) {
+            throw std::invalid_argument("Bits per pixel must be 8, 16, 24, or 32.");
+        }
+
+        const bmp_detail::BMPFILEHEADER header(_width, _height, _bpp, top_down);
+        const std::vector<unsigned char> table = bmp_detail::colorTable(_bpp);
+
+        // The buffer holds at least one row, and the header and color table
+        // together, however small buffer_size is.
+        row_size = (std::size_t)_width * (_bpp / 8);
+        padded_size = bmp_detail::rowSize(_width, _bpp);
+        buffer.resize(std::max({ buffer_size, padded_size, sizeof(header) + table.size() }));
+
+        fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            throw std::runtime_error(file_name + " could not be opened for writing.");
+        }
+
+        std::memcpy(buffer.data(), &header, sizeof(header));
+        used = sizeof(header);
+        if(!table.empty()) {
+            std::memcpy(buffer.data() + used, table.data(), table.size());
+            used += table.size();
+        }
+    }
+
+    BMPWriter(const BMPWriter&) = delete;
+    BMPWriter& operator=(const BMPWriter&) = delete;
+
+    ~BMPWriter()
+    {
+        try {
+            close();
+        } catch(...) {
+        }
+    }
+
+    // Copies rowSize() bytes from row and pads them out.
+    void writeRow(const unsigned char* row)
+    {
+        if(rows == height) {
+            throw std::out_of_range("All rows of the bitmap have already been written.");
+        }
+        if(used + padded_size > buffer.size()) { flush(); }
+        std::memcpy(buffer.data() + used, row, row_size);
+        std::memset(buffer.data() + used + row_size, 0, padded_size - row_size);
+        used += padded_size;
+        rows++;
+    }
+
+    std::size_t rowSize() const
+    {
+        return row_size;
+    }
+
+    // Throws if fewer rows were written than the header promised.
+    void close()
+    {
+        if(fd < 0) { return; }
+        try {
+            flush();
+        } catch(...) {
+            ::close(fd);
+            fd = -1;
+            throw;
+        }
+        ::close(fd);
+        fd = -1;
+        if(rows != height) {
+            throw std::runtime_error("Bitmap closed after " + std::to_string(rows) + " of " + std::to_string(height) + " rows.");
+        }
+    }
+
+private:
+    void flush()
+    {
+        bmp_detail::writeFully(fd, buffer.data(), used);
+        used = 0;
+    }
+
+    int fd { -1 };
+    std::vector<unsigned char> buffer;
+    std::size_t used { 0 };
+    std::size_t row_size { 0 };
+    std::size_t padded_size { 0 };
+    unsigned int rows { 0 };
+    unsigned int height;
+};
+
+// Keeps the buffers of finished frames and hands them to new frames that fit,
+// so a steady stream of frames allocates nothing. A recycled frame still holds
+// what the last one drew; call fill() first if that matters. Safe to share
+// between threads.
+class BMPPool
+{
+public:
+    explicit BMPPool(std::size_t _max_buffers = 16) : max_buffers(_max_buffers) {}
+
+    BMPPool(const BMPPool&) = delete;
+    BMPPool& operator=(const BMPPool&) = delete;
+
+    ~BMPPool()
+    {
+        clear();
+    }
+
+    // Takes the smallest pooled buffer that fits, or allocates a zeroed one.
+    BMP acquire(const std::string& file_name, unsigned int width, unsigned int height, unsigned int bpp = 24)
+    {
+        BMP::validate(file_name, width, height, bpp);
+        const std::size_t bytes = (std::size_t)width * height * (bpp / 8);
+
+        unsigned char* buffer = nullptr;
+        std::size_t capacity = bytes;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            auto it = buffers.lower_bound(bytes);
+            if(it != buffers.end()) {
+                capacity = it->first;
+                buffer = it->second;
+                buffers.erase(it);
+            }
+        }
+        if(buffer == nullptr) {
+            buffer = bmp_detail::allocate(bytes);
+            std::memset(buffer, 0, bytes);
+        }
+        return BMP(file_name, width, height, bpp, buffer, capacity);
+    }
+
+    // Takes the frame's buffer back and leaves the frame empty. Frames opened
+    // from a file are only unmapped.
+    void recycle(BMP& frame)
+    {
+        unsigned char* buffer;
+        std::size_t capacity;
+        if(!frame.detach(buffer, capacity)) { return; }
+
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if(buffers.size() < max_buffers) {
+                buffers.emplace(capacity, buffer);
+                return;
+            }
+        }
+        bmp_detail::deallocate(buffer);
+    }
+
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(m);
+        return buffers.size();
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        for(auto& buffer : buffers) {
+            bmp_detail::deallocate(buffer.second);
+        }
+        buffers.clear();
+    }
+
+private:
+    std::multimap<std::size_t, unsigned char*> buffers;
+    std::size_t max_buffers;
+    mutable std::mutex m;
 };
\ No newline at end of file
@@ -0,0 +1,411 @@
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <ostream>
+#include <iomanip>
+#include <sstream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <new>
+#include <thread>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Micro-benchmark harness: time a function over enough iterations to be
+// measurable, and report ns/op, bytes/s, heap allocations per op and, where
+// the kernel allows perf_event_open, hardware counters. Results print as a
+// table or as JSON, so runs of two versions can be diffed.
+//
+// Heap allocations are only counted in a program where exactly one file
+// defines BENCHMARK_COUNT_ALLOCATIONS before including this header, which
+// replaces the global operator new and delete with counting versions.
+namespace bench_detail
+{
+    inline std::atomic<std::uint64_t> allocations { 0 };
+    inline std::atomic<std::uint64_t> allocated_bytes { 0 };
+
+    // Keeps the compiler from optimizing away a value that is never used.
+    template <typename T>
+    inline void use(const T& value)
+    {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    // Hardware counters of the calling thread and of every thread it starts
+    // while they exist, so parallel benchmarks count all their workers. A
+    // worker's counts are added when it exits, and a reset does not clear
+    // them, so a measurement is the difference of two reads. The kernel
+    // rejects group reads of inherited counters, so every counter has its own
+    // descriptor. Any counter the kernel refuses is left out; when cycles is
+    // refused, none are used.
+    class PerfCounters
+    {
+    public:
+        struct Event
+        {
+            const char* name;
+            std::uint32_t type;
+            std::uint64_t config;
+        };
+
+        PerfCounters()
+        {
+#if defined(__linux__)
+            static const Event events[] {
+                { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+                { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+                { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+                { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+            };
+            for(const Event& event : events) {
+                perf_event_attr attr;
+                std::memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = event.type;
+                attr.config = event.config;
+                attr.disabled = 1;
+                attr.inherit = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                int fd = (int)::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+                if(fd < 0) {
+                    if(fds.empty()) { return; }
+                    continue;
+                }
+                fds.push_back(fd);
+                names.push_back(event.name);
+                base.push_back(0);
+            }
+#endif
+        }
+
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        ~PerfCounters()
+        {
+#if defined(__linux__)
+            for(int fd : fds) {
+                ::close(fd);
+            }
+#endif
+        }
+
+        bool available() const
+        {
+            return !fds.empty();
+        }
+
+        void start()
+        {
+#if defined(__linux__)
+            for(std::size_t i = 0; i < fds.size(); ++i) {
+                base[i] = value(fds[i]);
+                ::ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        // Stops counting and returns the name and count of every counter.
+        std::vector<std::pair<std::string, double>> stop()
+        {
+            std::vector<std::pair<std::string, double>> counts;
+#if defined(__linux__)
+            for(int fd : fds) {
+                ::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+            for(std::size_t i = 0; i < fds.size(); ++i) {
+                counts.emplace_back(names[i], (double)(value(fds[i]) - base[i]));
+            }
+#endif
+            return counts;
+        }
+
+    private:
+        static std::uint64_t value(int fd)
+        {
+            std::uint64_t count = 0;
+#if defined(__linux__)
+            if(::read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count)) {
+                count = 0;
+            }
+#endif
+            return count;
+        }
+
+        std::vector<int> fds;
+        std::vector<std::string> names;
+        std::vector<std::uint64_t> base;
+    };
+
+    inline std::string escape(const std::string& text)
+    {
+        std::string out;
+        for(char c : text) {
+            if(c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if((unsigned char)c < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", c);
+                out += code;
+            } else {
+                out += c;
+            }
+        }
+        return out;
+    }
+}
+
+#if defined(BENCHMARK_COUNT_ALLOCATIONS)
+// GCC cannot tell that these news and deletes are a matching pair once they
+// are inlined into the same file, and warns about every container.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    bench_detail::allocations.fetch_add(1, std::memory_order_relaxed);
+    bench_detail::allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if(void* p = std::malloc(size ? size : 1)) { return p; }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    bench_detail::allocations.fetch_add(1, std::memory_order_relaxed);
+    bench_detail::allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    const std::size_t a = std::max<std::size_t>((std::size_t)alignment, sizeof(void*));
+    if(void* p = std::aligned_alloc(a, (std::max<std::size_t>(size, 1) + a - 1) / a * a)) { return p; }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+class Benchmark
+{
+public:
+    // A benchmark runs its operation iterations times per call. Setup that
+    // should not be timed belongs outside the returned function.
+    using Function = std::function<void(std::size_t iterations)>;
+
+    // Builds a benchmark's input and returns the function that times it, for
+    // inputs too large to keep around for every case. It only runs when the
+    // case is selected, and the input is released once the case is done.
+    using Setup = std::function<Function()>;
+
+    // Figures a case knows about itself rather than measures, such as the
+    // bytes its algorithm moves per element, printed next to its results.
+    using Metrics = std::vector<std::pair<std::string, double>>;
+
+    struct Result
+    {
+        std::string name;
+        std::size_t iterations;
+        double ns_per_op;
+        double bytes_per_second; // NaN without bytes or a measurable time
+        double allocations_per_op;
+        double allocated_bytes_per_op;
+        std::vector<std::pair<std::string, double>> counters; // Per op
+        Metrics metrics;
+    };
+
+    // bytes is the data one operation processes, for bytes/s, or zero.
+    void add(const std::string& name, Function fn, std::size_t bytes = 0, Metrics metrics = {})
+    {
+        cases.push_back(Case { name, std::move(fn), bytes, nullptr, std::move(metrics) });
+    }
+
+    void addWithSetup(const std::string& name, Setup setup, std::size_t bytes = 0)
+    {
+        cases.push_back(Case { name, nullptr, bytes, std::move(setup), {} });
+    }
+
+    void setMinTime(double seconds)
+    {
+        min_time = seconds;
+    }
+
+    // Runs every benchmark whose name contains filter. The iteration count
+    // grows until one timed call lasts min_time, and that call is reported.
+    std::vector<Result> run(const std::string& filter = "")
+    {
+        std::vector<Result> results;
+        bench_detail::PerfCounters perf;
+        perf_available = perf.available();
+
+        for(const Case& c : cases) {
+            if(c.name.find(filter) == std::string::npos) { continue; }
+
+            Function prepared;
+            if(c.setup) {
+                prepared = c.setup();
+            }
+            const Function& fn = c.setup ? prepared : c.fn;
+
+            std::size_t iterations = 1;
+            for(;;) {
+                const std::uint64_t allocations = bench_detail::allocations.load();
+                const std::uint64_t bytes = bench_detail::allocated_bytes.load();
+                perf.start();
+                const auto start = std::chrono::steady_clock::now();
+                fn(iterations);
+                const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                auto counts = perf.stop();
+
+                if(seconds >= min_time || iterations >= (std::size_t(1) << 40)) {
+                    Result result;
+                    result.name = c.name;
+                    result.iterations = iterations;
+                    result.ns_per_op = seconds * 1e9 / iterations;
+                    result.bytes_per_second = c.bytes != 0 && seconds > 0.0 ? c.bytes * (double)iterations / seconds : std::numeric_limits<double>::quiet_NaN();
+                    result.allocations_per_op = (double)(bench_detail::allocations.load() - allocations) / iterations;
+                    result.allocated_bytes_per_op = (double)(bench_detail::allocated_bytes.load() - bytes) / iterations;
+                    for(auto& count : counts) {
+                        result.counters.emplace_back(count.first, count.second / iterations);
+                    }
+                    result.metrics = c.metrics;
+                    results.push_back(std::move(result));
+                    break;
+                }
+
+                // Aim straight for min_time once a call takes long enough to
+                // predict from, instead of doubling all the way.
+                const double target = seconds > 1e-3 ? min_time / seconds * 1.2 : 2.0;
+                iterations = std::max(iterations + 1, (std::size_t)(iterations * std::min(target, 100.0)));
+            }
+        }
+        return results;
+    }
+
+    bool perfAvailable() const
+    {
+        return perf_available;
+    }
+
+    static void writeTable(std::ostream& out, const std::vector<Result>& results)
+    {
+        std::size_t width = 9;
+        for(const Result& r : results) {
+            width = std::max(width, r.name.size());
+        }
+
+        out << std::left << std::setw(width) << "benchmark" << std::right
+            << std::setw(14) << "ns/op" << std::setw(12) << "MB/s" << std::setw(12) << "allocs/op" << std::setw(14) << "instr/op" << "\n";
+        for(const Result& r : results) {
+            double instructions = 0.0;
+            for(auto& counter : r.counters) {
+                if(counter.first == "instructions") { instructions = counter.second; }
+            }
+            out << std::left << std::setw(width) << r.name << std::right << std::fixed << std::setprecision(1)
+                << std::setw(14) << r.ns_per_op << std::setw(12);
+            if(std::isfinite(r.bytes_per_second)) {
+                out << r.bytes_per_second / 1e6;
+            } else {
+                out << "-";
+            }
+            out << std::setw(12) << std::setprecision(2) << r.allocations_per_op
+                << std::setw(14) << std::setprecision(0) << instructions;
+            for(auto& metric : r.metrics) {
+                out << "  " << metric.first << "=" << std::setprecision(2) << metric.second;
+            }
+            out << "\n";
+        }
+    }
+
+    void writeJSON(std::ostream& out, const std::vector<Result>& results) const
+    {
+        out << "{\n  \"context\": {\n";
+        out << "    \"compiler\": \"" << bench_detail::escape(compiler()) << "\",\n";
+        out << "    \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+        out << "    \"perf_counters\": " << (perf_available ? "true" : "false") << ",\n";
+        out << "    \"min_time\": " << min_time << "\n  },\n  \"benchmarks\": [\n";
+
+        for(std::size_t i = 0; i < results.size(); ++i) {
+            const Result& r = results[i];
+            std::ostringstream line;
+            line << std::setprecision(6);
+            line << "    {\"name\": \"" << bench_detail::escape(r.name) << "\", \"iterations\": " << r.iterations
+                 << ", \"ns_per_op\": " << number(r.ns_per_op) << ", \"bytes_per_second\": " << number(r.bytes_per_second)
+                 << ", \"allocations_per_op\": " << number(r.allocations_per_op) << ", \"allocated_bytes_per_op\": " << number(r.allocated_bytes_per_op);
+            for(auto& counter : r.counters) {
+                line << ", \"" << counter.first << "_per_op\": " << number(counter.second);
+            }
+            for(auto& metric : r.metrics) {
+                line << ", \"" << bench_detail::escape(metric.first) << "\": " << number(metric.second);
+            }
+            line << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+            out << line.str();
+        }
+        out << "  ]\n}\n";
+    }
+
+private:
+    struct Case
+    {
+        std::string name;
+        Function fn;
+        std::size_t bytes;
+        Setup setup;
+        Metrics metrics;
+    };
+
+    // JSON has no inf or nan, so those are written as null.
+    static std::string number(double value)
+    {
+        if(!std::isfinite(value)) { return "null"; }
+        std::ostringstream out;
+        out << std::setprecision(6) << value;
+        return out.str();
+    }
+
+    static std::string compiler()
+    {
+#if defined(__clang__)
+        return "clang " __clang_version__;
+#elif defined(__GNUC__)
+        return "gcc " __VERSION__;
+#else
+        return "unknown";
+#endif
+    }
+
+    std::vector<Case> cases;
+    double min_time { 0.2 };
+    bool perf_available { false };
+};
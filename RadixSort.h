@@ -1,34 +1,346 @@
-// Simple RadixSort implentation based on the code from https://www.geeksforgeeks.org/radix-sort/ and slightly reworked using stl containers
+// LSD RadixSort over bytes (radix 256), originally based on the code from https://www.geeksforgeeks.org/radix-sort/
+// Sorts every integer width, signed or unsigned, as well as float and double. Keys are mapped to unsigned
+// integers that compare the same way, then sorted one byte per pass, ping-ponging between the input and a
+// single scratch buffer.
 
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-inline void radixSort(std::vector<int>& arr)
+namespace radix_detail
 {
-    int n = arr.size();
-    int m = 0;
-    for(const auto& a : arr) { if(a > m) { m = a; } }
-    
-    std::vector<int> sorted_arr;
-    sorted_arr.resize(arr.size());
+    // Maps a key to an unsigned integer of the same width whose unsigned order
+    // matches the key's order.
+    template <typename K, typename Enable = void>
+    struct RadixKey;
 
-    for (int exp = 1; m / exp > 0; exp *= 10) {
-        int count[10] { 0 };
+    template <typename K>
+    struct RadixKey<K, typename std::enable_if<std::is_integral<K>::value && !std::is_same<K, bool>::value>::type>
+    {
+        using type = typename std::make_unsigned<K>::type;
 
-        for (int i = 0; i < n; i++) {
-            count[(arr[i] / exp) % 10]++;
+        static type encode(K key)
+        {
+            type bits = static_cast<type>(key);
+            if(std::is_signed<K>::value) {
+                bits ^= type(1) << (sizeof(type) * 8 - 1); // Negative values sort below positive ones
+            }
+            return bits;
         }
+    };
 
-        for (int i = 1; i < 10; i++){
-            count[i] += count[i - 1];
+    template <typename K>
+    struct RadixKey<K, typename std::enable_if<std::is_floating_point<K>::value>::type>
+    {
+        static_assert(sizeof(K) == 4 || sizeof(K) == 8, "Only float and double keys are supported.");
+        using type = typename std::conditional<sizeof(K) == 4, std::uint32_t, std::uint64_t>::type;
+
+        // IEEE 754: flip every bit of negative values so larger magnitudes sort
+        // lower, and only the sign bit of positive values.
+        static type encode(K key)
+        {
+            type bits;
+            std::memcpy(&bits, &key, sizeof(bits));
+            const type sign = type(1) << (sizeof(type) * 8 - 1);
+            return (bits & sign) ? ~bits : (bits | sign);
+        }
+    };
+
+    // Below this many elements the parallel sort falls back to the serial one,
+    // the threads would cost more than they save. Defining
+    // RADIX_MIN_PARALLEL_SIZE moves the crossover, the benchmarks set it to 0
+    // to time the parallel path on either side of the default.
+#if defined(RADIX_MIN_PARALLEL_SIZE)
+    constexpr std::size_t min_parallel_size = RADIX_MIN_PARALLEL_SIZE;
+#else
+    constexpr std::size_t min_parallel_size = 1 << 18;
+#endif
+
+    // Moves src[0..n) to their buckets in dst. Elements are gathered in a cache
+    // line sized staging area per bucket and written out a whole line at a
+    // time with non-temporal stores, so the 256 output streams neither read
+    // the destination lines before writing them nor evict the input from the
+    // cache. The first write of each bucket is shortened to reach a cache line
+    // boundary. sizeof(T) must divide 64.
+    template <typename T, typename KeyFn, typename Traits>
+    void scatterCombined(T* src, T* dst, std::size_t n, std::size_t* offsets, KeyFn& key, unsigned int shift, Traits)
+    {
+        constexpr std::size_t line = 64 / sizeof(T);
+        alignas(64) T stage[256][line];
+        std::size_t fill[256];
+        std::size_t limit[256];
+
+        for(unsigned int d = 0; d < 256; ++d) {
+            std::size_t misaligned = (reinterpret_cast<std::uintptr_t>(dst + offsets[d]) % 64) / sizeof(T);
+            fill[d] = 0;
+            limit[d] = line - misaligned;
+        }
+
+        for(std::size_t i = 0; i < n; ++i) {
+            unsigned int d = (Traits::encode(key(src[i])) >> shift) & 0xFF;
+            stage[d][fill[d]] = src[i];
+            if(++fill[d] == limit[d]) {
+                T* out = dst + offsets[d];
+#if defined(__SSE2__)
+                if(limit[d] == line) {
+                    const __m128i* in = reinterpret_cast<const __m128i*>(stage[d]);
+                    __m128i* o = reinterpret_cast<__m128i*>(out);
+                    _mm_stream_si128(o + 0, _mm_load_si128(in + 0));
+                    _mm_stream_si128(o + 1, _mm_load_si128(in + 1));
+                    _mm_stream_si128(o + 2, _mm_load_si128(in + 2));
+                    _mm_stream_si128(o + 3, _mm_load_si128(in + 3));
+                } else
+#endif
+                {
+                    std::memcpy(out, stage[d], limit[d] * sizeof(T));
+                }
+                offsets[d] += limit[d];
+                fill[d] = 0;
+                limit[d] = line;
+            }
+        }
+#if defined(__SSE2__)
+        _mm_sfence();
+#endif
+
+        for(unsigned int d = 0; d < 256; ++d) {
+            std::memcpy(dst + offsets[d], stage[d], fill[d] * sizeof(T));
+            offsets[d] += fill[d];
+        }
+    }
+
+    // LSD sort of the low bits of every key, ping-ponging between data and
+    // scratch. A single read up front builds the histogram of every pass, as
+    // moving elements around does not change them. Passes where every key has
+    // the same digit are skipped. Returns whichever of the two buffers holds
+    // the sorted result.
+    template <typename T, typename KeyFn>
+    T* lsdSort(T* data, T* scratch, std::size_t n, KeyFn& key, unsigned int bits)
+    {
+        using Traits = RadixKey<typename std::decay<decltype(key(*data))>::type>;
+        using Bits = typename Traits::type;
+
+        const unsigned int passes = (bits + 7) / 8;
+        std::array<std::array<std::size_t, 256>, sizeof(Bits)> counts {};
+        for(std::size_t i = 0; i < n; ++i) {
+            Bits k = Traits::encode(key(data[i]));
+            for(unsigned int p = 0; p < passes; ++p) {
+                counts[p][(k >> (p * 8)) & 0xFF]++;
+            }
+        }
+
+        // Staging only pays off once the array no longer fits in cache
+        constexpr bool can_combine = std::is_trivial<T>::value && sizeof(T) <= 16 && 64 % sizeof(T) == 0;
+        const bool combine = can_combine && n * sizeof(T) >= (1 << 20);
+
+        T* src = data;
+        T* dst = scratch;
+        for(unsigned int p = 0; p < passes; ++p) {
+            const unsigned int shift = p * 8;
+            std::array<std::size_t, 256>& count = counts[p];
+            if(count[(Traits::encode(key(src[0])) >> shift) & 0xFF] == n) { continue; }
+
+            std::size_t offset = 0;
+            for(std::size_t i = 0; i < 256; ++i) {
+                std::size_t c = count[i];
+                count[i] = offset;
+                offset += c;
+            }
+
+            if constexpr(can_combine) {
+                if(combine) {
+                    scatterCombined(src, dst, n, count.data(), key, shift, Traits());
+                    std::swap(src, dst);
+                    continue;
+                }
+            }
+
+            for(std::size_t i = 0; i < n; ++i) {
+                dst[count[(Traits::encode(key(src[i])) >> shift) & 0xFF]++] = std::move(src[i]);
+            }
+
+            std::swap(src, dst);
+        }
+        return src;
+    }
+
+    template <typename F>
+    void parallelFor(unsigned int count, F&& fn)
+    {
+        std::vector<std::thread> workers;
+        workers.reserve(count - 1);
+        for(unsigned int i = 1; i < count; ++i) {
+            workers.emplace_back([&fn, i]() { fn(i); });
+        }
+        fn(0);
+        for(auto& worker : workers) {
+            worker.join();
+        }
+    }
+}
+
+// Stable sort of arr by the integer or floating point key returned by key(element).
+template <typename T, typename KeyFn>
+void radixSortByKey(std::vector<T>& arr, KeyFn key)
+{
+    using Bits = typename radix_detail::RadixKey<typename std::decay<decltype(key(arr[0]))>::type>::type;
+
+    if(arr.size() < 2) { return; }
+
+    std::vector<T> buffer(arr.size());
+    if(radix_detail::lsdSort(arr.data(), buffer.data(), arr.size(), key, sizeof(Bits) * 8) != arr.data()) {
+        arr.swap(buffer);
+    }
+}
+
+template <typename T>
+void radixSort(std::vector<T>& arr)
+{
+    radixSortByKey(arr, [](const T& a) { return a; });
+}
+
+// Multi-threaded version of radixSortByKey. Every pass splits the array into
+// one slice per thread; each thread counts the digits of its slice, the counts
+// are merged into per thread write offsets (bucket by bucket, thread by thread,
+// so the sort stays stable), and each thread scatters its own slice. A pass is
+// skipped when the counts of all slices together put every key in one bucket.
+// 64-bit keys first partition on their highest varying byte and then sort the
+// 256 buckets independently, which halves the passes over the whole array.
+// Small inputs use the serial sort. threads = 0 uses one thread per hardware
+// thread.
+template <typename T, typename KeyFn>
+void parallelRadixSortByKey(std::vector<T>& arr, KeyFn key, unsigned int threads = 0)
+{
+    using Traits = radix_detail::RadixKey<typename std::decay<decltype(key(arr[0]))>::type>;
+    using Bits = typename Traits::type;
+
+    if(threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    const std::size_t n = arr.size();
+    if(threads == 1 || n < 2 || n < radix_detail::min_parallel_size) {
+        radixSortByKey(arr, key);
+        return;
+    }
+
+    std::vector<T> buffer(n);
+    T* src = arr.data();
+    T* dst = buffer.data();
+    std::vector<std::array<std::size_t, 256>> counts(threads);
+    auto begin = [&](unsigned int t) { return n / threads * t; };
+    auto end = [&](unsigned int t) { return t + 1 == threads ? n : n / threads * (t + 1); };
+
+    // Counts the digit at shift per thread slice and turns the counts into
+    // write offsets. Returns false when every key has the same digit.
+    auto prepare = [&](unsigned int shift) {
+        radix_detail::parallelFor(threads, [&](unsigned int t) {
+            auto& count = counts[t];
+            count.fill(0);
+            for(std::size_t i = begin(t); i < end(t); ++i) {
+                count[(Traits::encode(key(src[i])) >> shift) & 0xFF]++;
+            }
+        });
+
+        // A digit is uniform when one bucket holds every key over all slices
+        for(std::size_t b = 0; b < 256; ++b) {
+            std::size_t total = 0;
+            for(unsigned int t = 0; t < threads; ++t) {
+                total += counts[t][b];
+            }
+            if(total == n) { return false; }
+            if(total != 0) { break; }
         }
 
-        for (int i = n - 1; i >= 0; i--) {
-            sorted_arr[count[(arr[i] / exp) % 10] - 1] = arr[i];
-            count[(arr[i] / exp) % 10]--;
+        std::size_t offset = 0;
+        for(std::size_t b = 0; b < 256; ++b) {
+            for(unsigned int t = 0; t < threads; ++t) {
+                std::size_t c = counts[t][b];
+                counts[t][b] = offset;
+                offset += c;
+            }
         }
+        return true;
+    };
 
-        for(int i = 0; i < n; i++) {
-            arr[i] = sorted_arr[i];
+    auto scatter = [&](unsigned int shift) {
+        radix_detail::parallelFor(threads, [&](unsigned int t) {
+            auto& offsets = counts[t];
+            for(std::size_t i = begin(t); i < end(t); ++i) {
+                dst[offsets[(Traits::encode(key(src[i])) >> shift) & 0xFF]++] = std::move(src[i]);
+            }
+        });
+        std::swap(src, dst);
+    };
+
+    if(sizeof(Bits) < 8) {
+        for(unsigned int shift = 0; shift < sizeof(Bits) * 8; shift += 8) {
+            if(prepare(shift)) { scatter(shift); }
+        }
+        if(src != arr.data()) {
+            arr.swap(buffer);
+        }
+        return;
+    }
+
+    // MSD: partition on the highest byte that is not the same for every key,
+    // found in one pass from the bits where any key differs from the first.
+    const Bits first = Traits::encode(key(src[0]));
+    std::vector<Bits> differ(threads, 0);
+    radix_detail::parallelFor(threads, [&](unsigned int t) {
+        Bits bits = 0;
+        for(std::size_t i = begin(t); i < end(t); ++i) {
+            bits |= Traits::encode(key(src[i])) ^ first;
         }
+        differ[t] = bits;
+    });
+    Bits varying = 0;
+    for(Bits bits : differ) {
+        varying |= bits;
+    }
+    if(varying == 0) { return; }
+
+    int shift = sizeof(Bits) * 8 - 8;
+    while((varying >> shift) == 0) {
+        shift -= 8;
     }
+    prepare(shift);
+
+    std::array<std::size_t, 257> bounds;
+    for(std::size_t b = 0; b < 256; ++b) {
+        bounds[b] = counts[0][b];
+    }
+    bounds[256] = n;
+    scatter(shift);
+
+    // The buckets now sit in order in buffer, LSD sort each one on the bytes
+    // below shift and leave the result in arr.
+    std::atomic<std::size_t> next { 0 };
+    radix_detail::parallelFor(threads, [&](unsigned int) {
+        for(std::size_t b = next++; b < 256; b = next++) {
+            std::size_t first = bounds[b];
+            std::size_t length = bounds[b + 1] - first;
+            if(length == 0) { continue; }
+
+            T* sorted = radix_detail::lsdSort(buffer.data() + first, arr.data() + first, length, key, shift);
+            if(sorted != arr.data() + first) {
+                std::move(sorted, sorted + length, arr.data() + first);
+            }
+        }
+    });
+}
+
+template <typename T>
+void parallelRadixSort(std::vector<T>& arr, unsigned int threads = 0)
+{
+    parallelRadixSortByKey(arr, [](const T& a) { return a; }, threads);
 }
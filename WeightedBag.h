@@ -3,45 +3,406 @@
 
 #include <vector>
 #include <exception>
+#include <stdexcept>
 #include <random>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <cmath>
 
-template <typename T>
+// xoshiro256** by Blackman and Vigna: a small, fast generator with 256 bits of
+// state that meets the UniformRandomBitGenerator requirements.
+class Xoshiro256StarStar
+{
+public:
+	using result_type = std::uint64_t;
+
+	explicit Xoshiro256StarStar(std::uint64_t seed = 0x9E3779B97F4A7C15ull)
+	{
+		// Spread the seed over the state with splitmix64
+		for (auto& word : s) {
+			seed += 0x9E3779B97F4A7C15ull;
+			std::uint64_t z = seed;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			word = z ^ (z >> 31);
+		}
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()()
+	{
+		const std::uint64_t result = rotl(s[1] * 5, 7) * 9;
+		const std::uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return result;
+	}
+
+private:
+	static std::uint64_t rotl(std::uint64_t x, int k)
+	{
+		return (x << k) | (x >> (64 - k));
+	}
+
+	std::uint64_t s[4];
+};
+
+// Draws items with a probability proportional to their weight. Entries are
+// addressed by the handle addEntry() returns, which stays valid until the entry
+// is removed. Weights live in a Fenwick tree, so updating or removing an entry
+// costs O(log n) and so does a draw in BINARY_SEARCH mode.
+//
+// Draws through the bag's own generator are not thread-safe. For sampling from
+// many threads, fill the bag, call prepare(), then have every thread pass its
+// own generator to the const getRandom(generator) or sample(n, out, generator).
+template <typename T, typename Rng = Xoshiro256StarStar>
 class WeightedBag
 {
 public:
-	void addEntry(T item, double weight)
+	using Handle = std::size_t;
+
+	// ALIAS draws in O(1) from a table that is rebuilt in O(n) after the bag
+	// changes, which suits bags that are filled once and sampled many times.
+	// BINARY_SEARCH draws in O(log n) by searching the Fenwick tree, so bags
+	// whose weights change between draws never pay for a rebuild.
+	enum class Mode
+	{
+		ALIAS = 0,
+		BINARY_SEARCH
+	};
+
+	WeightedBag() : rng(std::random_device{}()) {}
+
+	explicit WeightedBag(Rng _rng) : rng(_rng) {}
+
+	Handle addEntry(T item, double weight)
+	{
+		checkWeight(weight);
+		Handle h;
+		if (!freeHandles.empty()) {
+			h = freeHandles.back();
+			freeHandles.pop_back();
+			entries[h] = Entry<T> {0.0, std::move(item), false};
+		} else {
+			h = entries.size();
+			entries.push_back(Entry<T> {0.0, std::move(item), false});
+			treeAppend();
+		}
+		liveEntries++;
+		setWeight(h, weight);
+		return h;
+	}
+
+	void updateWeight(Handle h, double weight)
+	{
+		check(h);
+		checkWeight(weight);
+		setWeight(h, weight);
+	}
+
+	void remove(Handle h)
+	{
+		check(h);
+		setWeight(h, 0.0);
+		entries[h].removed = true;
+		freeHandles.push_back(h);
+		liveEntries--;
+	}
+
+	std::size_t size() const
+	{
+		return liveEntries;
+	}
+
+	void setMode(Mode _mode)
 	{
-		accumulatedWeight += weight;
-        	Entry<T> e {accumulatedWeight, item};
-		entries.push_back(e);
+		mode = _mode;
+	}
+
+	// Builds the alias table now instead of on the next draw, so that the const
+	// draws, which never modify the bag, can use it.
+	void prepare()
+	{
+		if (mode == Mode::ALIAS && !aliasValid) {
+			buildAliasTable();
+		}
 	}
 
 	T getRandom()
 	{
-		double r = (double)(rand() % 100) / 100.0 * accumulatedWeight;
+		prepare();
+		return entries[drawIndex(rng)].item;
+	}
 
-		for (auto e : entries) {
-			if (e.accumulatedWeight >= r) {
-				return e.item;
-			}
+	// Safe to call from many threads at once, each with its own generator. Uses
+	// the alias table if prepare() has been called since the last change and
+	// searches the Fenwick tree otherwise.
+	template <typename G>
+	T getRandom(G& generator) const
+	{
+		return entries[drawIndex(generator)].item;
+	}
+
+	// Draws n items into out and returns the iterator past the last one.
+	template <typename OutputIt>
+	OutputIt sample(std::size_t n, OutputIt out)
+	{
+		prepare();
+		return sample(n, out, rng);
+	}
+
+	template <typename OutputIt, typename G>
+	OutputIt sample(std::size_t n, OutputIt out, G& generator) const
+	{
+		for (std::size_t i = 0; i < n; ++i) {
+			*out++ = entries[drawIndex(generator)].item;
 		}
+		return out;
+	}
 
-		try {
-			return entries.at(0).item;
-		} catch(std::out_of_range e) {
-			throw std::out_of_range("Cannot get element from bag because it is empty.");
+	// Draws up to k distinct entries, each with a probability proportional to
+	// its weight among the entries not drawn yet. Stops early once every entry
+	// with a positive weight has been drawn. O(n + k log n) on a copy of the
+	// tree.
+	template <typename OutputIt>
+	OutputIt sampleWithoutReplacement(std::size_t k, OutputIt out)
+	{
+		return sampleWithoutReplacement(k, out, rng);
+	}
+
+	template <typename OutputIt, typename G>
+	OutputIt sampleWithoutReplacement(std::size_t k, OutputIt out, G& generator) const
+	{
+		std::vector<double> remaining(tree);
+		std::vector<bool> drawn(entries.size(), false);
+		auto available = [&](std::size_t i) { return !drawn[i] && entries[i].weight > 0.0; };
+		k = std::min(k, positiveEntries);
+		for (std::size_t i = 0; i < k; ++i) {
+			// Rounding leaves residue in the tree where drawn entries were, so
+			// a search can land on one of them or on a zero weight
+			std::size_t index = search(remaining, uniform(generator) * std::max(sum(remaining), 0.0));
+			if (!available(index)) {
+				index = nearest(index, available);
+			}
+			*out++ = entries[index].item;
+			drawn[index] = true;
+			add(remaining, index, -entries[index].weight);
 		}
+		return out;
 	}
 private:
 	template<typename P>
 	struct Entry
-    	{
-        	double accumulatedWeight;
-        	P item;
-    	};
+	{
+		double weight;
+		P item;
+		bool removed;
+	};
+
+	// One column of the alias table: the column's own entry is kept with
+	// probability, otherwise the draw goes to alias.
+	struct AliasSlot
+	{
+		double probability;
+		std::size_t alias;
+	};
+
+	void check(Handle h) const
+	{
+		if (h >= entries.size() || entries[h].removed) {
+			throw std::out_of_range("Handle does not refer to an entry in the bag.");
+		}
+	}
+
+	// Negative and non-finite weights would corrupt the tree sums and the
+	// alias table.
+	static void checkWeight(double weight)
+	{
+		if (!(weight >= 0.0) || !std::isfinite(weight)) {
+			throw std::invalid_argument("Weight must be a finite number that is not negative.");
+		}
+	}
+
+	void setWeight(Handle h, double weight)
+	{
+		positiveEntries += (weight > 0.0) - (entries[h].weight > 0.0);
+		add(tree, h, weight - entries[h].weight);
+		entries[h].weight = weight;
+		aliasValid = false;
+
+		// Without positive weights the tree must sum to exactly zero, so clear
+		// the rounding residue that the updates left behind.
+		if (positiveEntries == 0) {
+			std::fill(tree.begin(), tree.end(), 0.0);
+		}
+	}
+
+	// Fenwick tree over the weights, 1-based: tree[i] holds the sum of the
+	// weights of entries (i - lowbit(i), i].
+	static void add(std::vector<double>& fenwick, std::size_t index, double delta)
+	{
+		for (std::size_t i = index + 1; i < fenwick.size(); i += i & (~i + 1)) {
+			fenwick[i] += delta;
+		}
+	}
+
+	// Grows the tree by one zero weight entry in O(log n).
+	void treeAppend()
+	{
+		if (tree.empty()) {
+			tree.push_back(0.0);
+		}
+		std::size_t i = tree.size();
+		double sum = 0.0;
+		for (std::size_t j = i - 1; j > i - (i & (~i + 1)); j -= j & (~j + 1)) {
+			sum += tree[j];
+		}
+		tree.push_back(sum);
+	}
+
+	// Total weight, summed from the tree rather than kept on the side so that
+	// rounding in repeated updates can never push a draw past the last entry.
+	static double sum(const std::vector<double>& fenwick)
+	{
+		double total = 0.0;
+		for (std::size_t i = fenwick.empty() ? 0 : fenwick.size() - 1; i > 0; i -= i & (~i + 1)) {
+			total += fenwick[i];
+		}
+		return total;
+	}
+
+	// Index of the entry whose running weight range contains r, found by
+	// walking down the tree one power of two at a time.
+	static std::size_t search(const std::vector<double>& fenwick, double r)
+	{
+		const std::size_t n = fenwick.size() - 1;
+		std::size_t step = 1;
+		while (step * 2 <= n) {
+			step *= 2;
+		}
+
+		std::size_t pos = 0;
+		for (; step > 0; step /= 2) {
+			if (pos + step <= n && fenwick[pos + step] <= r) {
+				pos += step;
+				r -= fenwick[pos];
+			}
+		}
+		return std::min(pos, n - 1);
+	}
+
+	template <typename G>
+	std::size_t drawIndex(G& generator) const
+	{
+		if (liveEntries == 0) {
+			throw std::out_of_range("Cannot get element from bag because it is empty.");
+		}
+		if (positiveEntries == 0) {
+			for (std::size_t i = 0; i < entries.size(); ++i) {
+				if (!entries[i].removed) { return i; }
+			}
+		}
+
+		if (mode == Mode::BINARY_SEARCH || !aliasValid) {
+			// Residue from updates can put a draw on an entry that weighs 0 now
+			std::size_t index = search(tree, uniform(generator) * std::max(sum(tree), 0.0));
+			if (!(entries[index].weight > 0.0)) {
+				index = nearest(index, [this](std::size_t i) { return entries[i].weight > 0.0; });
+			}
+			return index;
+		}
+
+		// One number picks both the column and the side of it.
+		double u = uniform(generator) * aliasTable.size();
+		std::size_t i = std::min(static_cast<std::size_t>(u), aliasTable.size() - 1);
+		return (u - i) < aliasTable[i].probability ? i : aliasTable[i].alias;
+	}
+
+	// Closest entry to index, looking down first, that passes valid. Only
+	// called after rounding, so the entry is nearly always a neighbour.
+	template <typename Valid>
+	std::size_t nearest(std::size_t index, Valid valid) const
+	{
+		for (std::size_t i = index; i-- > 0;) {
+			if (valid(i)) { return i; }
+		}
+		for (std::size_t i = index + 1; i < entries.size(); ++i) {
+			if (valid(i)) { return i; }
+		}
+		return index;
+	}
+
+	// Vose's alias method: scale every weight so the average is 1, then pair
+	// each column below 1 with one above 1 that fills up the rest of it.
+	void buildAliasTable()
+	{
+		const std::size_t n = entries.size();
+		aliasTable.assign(n, AliasSlot {1.0, 0});
+
+		std::vector<double> scaled(n);
+		std::vector<std::size_t> small, large;
+		double total = 0.0;
+		std::size_t heaviest = 0;
+		for (std::size_t i = 0; i < n; ++i) {
+			total += entries[i].weight;
+			if (entries[i].weight > entries[heaviest].weight) {
+				heaviest = i;
+			}
+		}
+		for (std::size_t i = 0; i < n; ++i) {
+			scaled[i] = entries[i].weight * n / total;
+			(scaled[i] < 1.0 ? small : large).push_back(i);
+		}
+
+		while (!small.empty() && !large.empty()) {
+			std::size_t s = small.back();
+			std::size_t l = large.back();
+			small.pop_back();
+			aliasTable[s] = AliasSlot {scaled[s], l};
+			scaled[l] -= 1.0 - scaled[s];
+			if (scaled[l] < 1.0) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+
+		// Whatever is left is 1 up to rounding and keeps its own entry, unless
+		// rounding left behind an entry that must never be drawn.
+		for (std::size_t s : small) {
+			if (!(entries[s].weight > 0.0)) {
+				aliasTable[s] = AliasSlot {0.0, heaviest};
+			}
+		}
+		aliasValid = true;
+	}
+
+	// Uniform double in [0, 1) with the full 53 bits of precision.
+	template <typename G>
+	static double uniform(G& generator)
+	{
+		if constexpr (G::min() == 0 && G::max() == std::numeric_limits<std::uint64_t>::max()) {
+			return (generator() >> 11) * 0x1.0p-53;
+		} else {
+			return std::generate_canonical<double, std::numeric_limits<double>::digits>(generator);
+		}
+	}
 
 	std::vector<Entry<T>> entries;
-	double accumulatedWeight { 0.0 };
+	std::vector<double> tree;
+	std::vector<Handle> freeHandles;
+	std::vector<AliasSlot> aliasTable;
+	std::size_t liveEntries { 0 };
+	std::size_t positiveEntries { 0 };
+	bool aliasValid { false };
+	Mode mode { Mode::ALIAS };
+	Rng rng;
 };
 
 
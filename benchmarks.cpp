@@ -0,0 +1,817 @@
+// Benchmarks for every header in the repository, built on Benchmark.h.
+//
+// make && ./benchmarks [--filter=radix] [--min-time=0.5] [--json=results.json]
+//
+// Hardware counters need perf_event_open, which is refused in many containers
+// and when /proc/sys/kernel/perf_event_paranoid is above 2; the other numbers
+// are reported either way.
+#define BENCHMARK_COUNT_ALLOCATIONS
+// Time the parallel radix sort below its fallback threshold too, so the sweep
+// in addRadixSort() shows where it starts to pay off.
+#define RADIX_MIN_PARALLEL_SIZE 0
+#include "Benchmark.h"
+#include "RadixSort.h"
+#include "WeightedBag.h"
+#include "csv.h"
+#include "BMP.h"
+#include "config_loader.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <map>
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <unistd.h>
+
+namespace
+{
+    // Temporary files live in one directory that is removed on exit.
+    struct Scratch
+    {
+        Scratch()
+        {
+            char pattern[] = "/tmp/benchmarksXXXXXX";
+            if(::mkdtemp(pattern) == nullptr) {
+                throw std::runtime_error("Could not create a scratch directory.");
+            }
+            directory = pattern;
+        }
+
+        ~Scratch()
+        {
+            for(const std::string& file : files) {
+                ::unlink(file.c_str());
+            }
+            ::rmdir(directory.c_str());
+        }
+
+        std::string path(const std::string& name)
+        {
+            files.push_back(directory + "/" + name);
+            return files.back();
+        }
+
+        std::string directory;
+        std::vector<std::string> files;
+    };
+
+    enum class Distribution
+    {
+        UNIFORM = 0,
+        NARROW, // Only the low byte varies, so most passes are skipped
+        SORTED
+    };
+
+    const char* name(Distribution distribution)
+    {
+        switch(distribution) {
+            case Distribution::UNIFORM: return "uniform";
+            case Distribution::NARROW: return "narrow";
+            default: return "sorted";
+        }
+    }
+
+    template <typename T>
+    std::vector<T> keys(std::size_t n, Distribution distribution)
+    {
+        std::mt19937_64 generator(42);
+        std::vector<T> out(n);
+        for(T& key : out) {
+            std::uint64_t bits = generator();
+            if constexpr(std::is_floating_point<T>::value) {
+                key = distribution == Distribution::NARROW ? T(bits & 0xFF) : T((double)(std::int64_t)bits / 1e6);
+            } else {
+                key = distribution == Distribution::NARROW ? T(bits & 0xFF) : T(bits);
+            }
+        }
+        if(distribution == Distribution::SORTED) {
+            std::sort(out.begin(), out.end());
+        }
+        return out;
+    }
+
+    template <typename T>
+    void addRadix(Benchmark& bench, const std::string& type, std::size_t n)
+    {
+        for(Distribution distribution : { Distribution::UNIFORM, Distribution::NARROW, Distribution::SORTED }) {
+            auto input = std::make_shared<std::vector<T>>(keys<T>(n, distribution));
+            const std::string suffix = type + "/" + name(distribution) + "/" + std::to_string(n);
+            const std::size_t bytes = n * sizeof(T);
+
+            bench.add("radix/radixSort/" + suffix, [input](std::size_t iterations) {
+                std::vector<T> work;
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    work = *input;
+                    radixSort(work);
+                    bench_detail::use(work.front());
+                }
+            }, bytes);
+
+            bench.add("radix/std::sort/" + suffix, [input](std::size_t iterations) {
+                std::vector<T> work;
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    work = *input;
+                    std::sort(work.begin(), work.end());
+                    bench_detail::use(work.front());
+                }
+            }, bytes);
+        }
+    }
+
+    // radixSort as it was before the byte-wise rewrite: base 10, non-negative
+    // ints only, with a copy back to arr after every digit. Kept as the
+    // baseline for the current sort.
+    void referenceRadixSort(std::vector<int>& arr)
+    {
+        int n = arr.size();
+        int m = 0;
+        for(const auto& a : arr) { if(a > m) { m = a; } }
+
+        std::vector<int> sorted_arr;
+        sorted_arr.resize(arr.size());
+
+        for(int exp = 1; m / exp > 0; exp *= 10) {
+            int count[10] { 0 };
+            for(int i = 0; i < n; i++) {
+                count[(arr[i] / exp) % 10]++;
+            }
+            for(int i = 1; i < 10; i++) {
+                count[i] += count[i - 1];
+            }
+            for(int i = n - 1; i >= 0; i--) {
+                sorted_arr[count[(arr[i] / exp) % 10] - 1] = arr[i];
+                count[(arr[i] / exp) % 10]--;
+            }
+            for(int i = 0; i < n; i++) {
+                arr[i] = sorted_arr[i];
+            }
+        }
+    }
+
+    // Bytes each sort reads and writes per element of input, counted from its
+    // passes rather than measured, so it is reported without perf counters.
+    // The reference scans for the maximum, then per decimal digit of it reads
+    // to count, reads and writes to scatter, and reads and writes to copy back.
+    double referenceBytesMoved(const std::vector<int>& input)
+    {
+        int m = 0;
+        for(int key : input) { m = std::max(m, key); }
+        std::size_t digits = 0;
+        for(int exp = 1; m / exp > 0; exp *= 10) {
+            digits++;
+        }
+        return sizeof(int) * (1.0 + 5.0 * digits);
+    }
+
+    // radixSort reads once for all its histograms, then reads and writes once
+    // for every byte that is not the same in all keys.
+    template <typename T>
+    double radixBytesMoved(const std::vector<T>& input)
+    {
+        using Traits = radix_detail::RadixKey<T>;
+        typename Traits::type varying = 0;
+        for(const T& key : input) {
+            varying |= Traits::encode(key) ^ Traits::encode(input.front());
+        }
+        std::size_t passes = 0;
+        for(std::size_t byte = 0; byte < sizeof(T); ++byte) {
+            passes += ((varying >> (byte * 8)) & 0xFF) != 0;
+        }
+        return sizeof(T) * (1.0 + 2.0 * passes);
+    }
+
+    void addRadixReference(Benchmark& bench, std::size_t n)
+    {
+        for(Distribution distribution : { Distribution::UNIFORM, Distribution::NARROW }) {
+            // Non-negative and below 10^9, as the reference cannot sort
+            // anything else: its digit multiplier overflows past that
+            auto input = std::make_shared<std::vector<int>>(keys<int>(n, distribution));
+            for(int& key : *input) {
+                key = (int)((unsigned int)key % 1000000000u);
+            }
+            const std::string suffix = std::string("int/") + name(distribution) + "/" + std::to_string(n);
+            const std::size_t bytes = n * sizeof(int);
+
+            bench.add("radix/reference/base10/" + suffix, [input](std::size_t iterations) {
+                std::vector<int> work;
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    work = *input;
+                    referenceRadixSort(work);
+                    bench_detail::use(work.front());
+                }
+            }, bytes, { { "bytes_moved_per_element", referenceBytesMoved(*input) } });
+
+            bench.add("radix/radixSort/" + suffix, [input](std::size_t iterations) {
+                std::vector<int> work;
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    work = *input;
+                    radixSort(work);
+                    bench_detail::use(work.front());
+                }
+            }, bytes, { { "bytes_moved_per_element", radixBytesMoved(*input) } });
+        }
+    }
+
+    void addRadixSort(Benchmark& bench)
+    {
+        addRadixReference(bench, 1 << 20);
+        addRadixReference(bench, 1 << 10);
+        addRadix<std::uint32_t>(bench, "uint32", 1 << 20);
+        addRadix<std::uint64_t>(bench, "uint64", 1 << 20);
+        addRadix<std::int64_t>(bench, "int64", 1 << 20);
+        addRadix<float>(bench, "float", 1 << 20);
+        addRadix<double>(bench, "double", 1 << 20);
+        addRadix<std::uint32_t>(bench, "uint32", 1 << 10);
+
+        // Crossover check for the parallel sort: every thread count up to the
+        // hardware's, on sizes either side of the default threshold of 2^18,
+        // next to the serial sort of the same keys.
+        const unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<unsigned> thread_counts;
+        for(unsigned threads = 1; threads < hardware; threads *= 2) {
+            thread_counts.push_back(threads);
+        }
+        thread_counts.push_back(hardware);
+
+        for(int shift : { 16, 17, 18, 19, 20, 22 }) {
+            const std::size_t n = std::size_t(1) << shift;
+            auto input = std::make_shared<std::vector<std::uint64_t>>(keys<std::uint64_t>(n, Distribution::UNIFORM));
+            const std::string suffix = "uint64/uniform/" + std::to_string(n);
+            const std::size_t bytes = n * sizeof(std::uint64_t);
+
+            if(shift != 20) {
+                bench.add("radix/radixSort/" + suffix, [input](std::size_t iterations) {
+                    std::vector<std::uint64_t> work;
+                    for(std::size_t i = 0; i < iterations; ++i) {
+                        work = *input;
+                        radixSort(work);
+                        bench_detail::use(work.front());
+                    }
+                }, bytes);
+            }
+
+            for(unsigned threads : thread_counts) {
+                bench.add("radix/parallelRadixSort/" + suffix + "/threads=" + std::to_string(threads), [input, threads](std::size_t iterations) {
+                    std::vector<std::uint64_t> work;
+                    for(std::size_t i = 0; i < iterations; ++i) {
+                        work = *input;
+                        parallelRadixSort(work, threads);
+                        bench_detail::use(work.front());
+                    }
+                }, bytes);
+            }
+        }
+    }
+
+    void addWeightedBag(Benchmark& bench)
+    {
+        using Bag = WeightedBag<int>;
+        for(std::size_t n : { std::size_t(16), std::size_t(1) << 10, std::size_t(1) << 20 }) {
+            for(Bag::Mode mode : { Bag::Mode::ALIAS, Bag::Mode::BINARY_SEARCH }) {
+                auto bag = std::make_shared<Bag>(Xoshiro256StarStar(7));
+                bag->setMode(mode);
+                std::mt19937 generator(1);
+                std::uniform_real_distribution<double> weight(0.1, 10.0);
+                for(std::size_t i = 0; i < n; ++i) {
+                    bag->addEntry((int)i, weight(generator));
+                }
+                bag->prepare();
+
+                const std::string suffix = std::string(mode == Bag::Mode::ALIAS ? "alias/" : "binary_search/") + std::to_string(n);
+                bench.add("bag/getRandom/" + suffix, [bag](std::size_t iterations) {
+                    int sum = 0;
+                    for(std::size_t i = 0; i < iterations; ++i) {
+                        sum += bag->getRandom();
+                    }
+                    bench_detail::use(sum);
+                });
+
+                // One weight change per draw: the alias table is rebuilt every
+                // time, which is the case BINARY_SEARCH exists for.
+                if(n <= (std::size_t(1) << 10)) {
+                    bench.add("bag/updateThenDraw/" + suffix, [bag, n](std::size_t iterations) {
+                        int sum = 0;
+                        for(std::size_t i = 0; i < iterations; ++i) {
+                            bag->updateWeight(i % n, 1.0 + (double)(i & 7));
+                            sum += bag->getRandom();
+                        }
+                        bench_detail::use(sum);
+                    });
+                }
+            }
+        }
+    }
+
+    // Writes rows x columns cells of field_size characters, with every tenth
+    // field quoted because it holds a delimiter.
+    std::size_t writeTable(const std::string& file, std::size_t rows, std::size_t columns, std::size_t field_size)
+    {
+        std::string plain(field_size, 'x');
+        std::string quoted = plain;
+        quoted[field_size / 2] = ',';
+        CSVWriter writer(file);
+        for(std::size_t row = 0; row < rows; ++row) {
+            for(std::size_t column = 0; column < columns; ++column) {
+                writer.writeField((row + column) % 10 == 0 ? quoted : plain);
+            }
+            writer.endRow();
+        }
+        writer.close();
+
+        std::ifstream in(file, std::ios::binary | std::ios::ate);
+        return (std::size_t)in.tellg();
+    }
+
+    // CSV::read() as it was before the scanner: a getline per row, an
+    // istringstream per row split on commas, and every cell stored under a
+    // lock in a map of maps. Kept as the baseline for the parsers.
+    struct ReferenceCSV
+    {
+        explicit ReferenceCSV(const std::string& file_name)
+        {
+            std::lock_guard<std::mutex> guard(file_m);
+            std::ifstream file(file_name);
+            if(!file.is_open()) {
+                throw std::runtime_error(file_name + " could not be opened for reading.");
+            }
+            unsigned int row = 0;
+            unsigned int column = 0;
+            for(std::string line; std::getline(file, line);) {
+                std::istringstream iss(line);
+                for(std::string token; std::getline(iss, token, ',');) {
+                    set(row, column, token);
+                    column++;
+                }
+                row++;
+                column = 0;
+            }
+        }
+
+        void set(unsigned int row, unsigned int column, const std::string& value)
+        {
+            std::lock_guard<std::mutex> guard(table_m);
+            if(row + 1 > max_height) { max_height = row + 1; }
+            if(column + 1 > max_width) { max_width = column + 1; }
+            table[row][column] = value;
+        }
+
+        std::map<unsigned int, std::map<unsigned int, std::string>> table;
+        unsigned int max_height { 0 };
+        unsigned int max_width { 0 };
+        std::mutex table_m;
+        std::mutex file_m;
+    };
+
+    void addCSV(Benchmark& bench, Scratch& scratch)
+    {
+        struct Shape
+        {
+            const char* name;
+            std::size_t rows;
+            std::size_t columns;
+            std::size_t field_size;
+        };
+        static const Shape shapes[] {
+            { "narrow/1MB", 1 << 14, 4, 15 },
+            { "wide/1MB", 1 << 10, 64, 15 },
+            { "narrow/16MB", 1 << 18, 4, 15 },
+            { "long_fields/16MB", 1 << 12, 16, 255 }
+        };
+
+        for(const Shape& shape : shapes) {
+            const std::string file = scratch.path(std::string("table_") + std::to_string(&shape - shapes) + ".csv");
+            const std::size_t bytes = writeTable(file, shape.rows, shape.columns, shape.field_size);
+            const std::string out = scratch.path(std::string("out_") + std::to_string(&shape - shapes) + ".csv");
+
+            bench.add(std::string("csv/CSVWriter/") + shape.name, [out, shape](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    writeTable(out, shape.rows, shape.columns, shape.field_size);
+                }
+            }, bytes);
+
+            bench.add(std::string("csv/CSVReader/") + shape.name, [file](std::size_t iterations) {
+                std::size_t fields = 0;
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    CSVReader reader(file);
+                    reader.forEach([&](const CSVReader::Row& row) { fields += row.size(); });
+                }
+                bench_detail::use(fields);
+            }, bytes);
+
+            // The structural scan alone, on a buffer already in memory
+            auto text = std::make_shared<std::string>();
+            {
+                std::ifstream in(file, std::ios::binary);
+                text->assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            }
+            bench.add(std::string("csv/CSVScanner/") + shape.name, [text](std::size_t iterations) {
+                CSVScanner scanner;
+                std::size_t structurals = 0;
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    scanner.scan(text->data(), text->size(), false, [&](std::size_t, bool) { structurals++; });
+                }
+                bench_detail::use(structurals);
+            }, bytes);
+
+            bench.add(std::string("csv/reference/getline_read/") + shape.name, [file](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    ReferenceCSV csv(file);
+                    bench_detail::use(csv.max_height);
+                }
+            }, bytes);
+
+            bench.add(std::string("csv/CSV::read/") + shape.name, [file](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    CSV csv(file, CSV::Mode::IN);
+                    bench_detail::use(csv.getLastRow());
+                }
+            }, bytes);
+
+            bench.add(std::string("csv/CSV::map/") + shape.name, [file](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    CSV csv(file, CSV::Mode::MAP);
+                    bench_detail::use(csv.getLastRow());
+                }
+            }, bytes);
+        }
+
+        // set() from many threads in concurrent mode, one op per cell, the
+        // final sync() included. Disjoint writers own every threads-th row, out
+        // of a window of 4096 per thread, and so mostly different shards;
+        // overlapping writers all write the same 16 rows and meet on the same
+        // few shard locks.
+        for(bool overlapping : { false, true }) {
+            for(unsigned int threads = 1; threads <= 64; threads *= 2) {
+                const std::string name = std::string("csv/concurrentSet/") + (overlapping ? "overlapping" : "disjoint") + "/threads=" + std::to_string(threads);
+                bench.add(name, [threads, overlapping](std::size_t iterations) {
+                    CSV csv;
+                    csv.enableConcurrentWrites();
+                    const std::string value = "0123456789";
+                    const std::size_t per_thread = (iterations + threads - 1) / threads;
+                    std::vector<std::thread> workers;
+                    for(unsigned int t = 0; t < threads; ++t) {
+                        workers.emplace_back([&, t]() {
+                            for(std::size_t i = 0; i < per_thread; ++i) {
+                                const unsigned int row = overlapping ? (unsigned int)(i % 16) : (unsigned int)((i % 4096) * threads + t);
+                                csv.set(row, (unsigned int)(i % 4), value);
+                            }
+                        });
+                    }
+                    for(auto& worker : workers) {
+                        worker.join();
+                    }
+                    csv.sync();
+                }, 10);
+            }
+        }
+    }
+
+    // The drawing code the span rasterizer replaced, on a 24 bpp buffer of
+    // width * height pixels: a sqrt per pixel of a circle's bounding box, and
+    // a cos and sin per pixel of a line. Only the signedness is tidied up, so
+    // it builds without warnings. Kept as the baseline for the bmp cases.
+    struct ReferenceCanvas
+    {
+        void set(int _x, int _y, unsigned char r, unsigned char g, unsigned char b)
+        {
+            if(_x >= 0 && _y >= 0 && _x < width && _y < height) {
+                pixels[(_y * width + _x) * 3 + 2] = r;
+                pixels[(_y * width + _x) * 3 + 1] = g;
+                pixels[(_y * width + _x) * 3 + 0] = b;
+            }
+        }
+
+        void circle(int x, int y, int radius, unsigned char r, unsigned char g, unsigned char b, bool fill)
+        {
+            for(int _y = y - radius; _y <= y + radius; ++_y) {
+                for(int _x = x - radius; _x <= x + radius; ++_x) {
+                    float distance = std::sqrt((float)((_x - x) * (_x - x) + (_y - y) * (_y - y)));
+                    if(fill ? distance < radius : std::abs(distance - (float)radius) < 0.5f) {
+                        set(_x, _y, r, g, b);
+                    }
+                }
+            }
+        }
+
+        void line(int x, int y, int x2, int y2, unsigned char r, unsigned char g, unsigned char b)
+        {
+            float angle = std::atan2((float)(y2 - y), (float)(x2 - x));
+            float distance = std::sqrt((float)((x2 - x) * (x2 - x) + (y2 - y) * (y2 - y)));
+            for(int i = 0; i < std::ceil(distance); ++i) {
+                set((int)(std::cos(angle) * i + x), (int)(std::sin(angle) * i + y), r, g, b);
+            }
+        }
+
+        void lineAD(int x, int y, float angle, int distance, unsigned char r, unsigned char g, unsigned char b)
+        {
+            for(int i = 0; i < distance; ++i) {
+                set((int)(std::cos(angle) * i + x), (int)(std::sin(angle) * i + y), r, g, b);
+            }
+        }
+
+        unsigned char* pixels;
+        int width;
+        int height;
+    };
+
+    // 10^5 primitives on an 8192x8192 canvas: circles, squares and short
+    // lines, with every 50th one a line across the whole canvas. Replays the
+    // same seeded sequence on a BMP or a BMP::Batch.
+    template <typename Canvas>
+    void scene8K(Canvas& canvas)
+    {
+        const unsigned int size = 8192;
+        std::mt19937 generator(5);
+        for(int i = 0; i < 100000; ++i) {
+            unsigned int x = generator() % size, y = generator() % size;
+            unsigned char c = (unsigned char)generator();
+            if(i % 50 == 0) {
+                // Edge to edge, left to right or top to bottom
+                unsigned int across = generator() % size;
+                if(i % 100 == 0) {
+                    canvas.line(0, y, size - 1, across, c, c, 0);
+                } else {
+                    canvas.line(x, 0, across, size - 1, 0, c, c);
+                }
+                continue;
+            }
+            switch(i % 3) {
+                case 0: canvas.circle(x, y, 4 + generator() % 40, c, 0, 0, i % 2 == 0); break;
+                case 1: canvas.square(x, y, 4 + generator() % 64, 4 + generator() % 64, 0, c, 0, i % 2 == 0); break;
+                default: canvas.line(x, y, x + generator() % 128, y + generator() % 128, 0, 0, c); break;
+            }
+        }
+    }
+
+    void addBMP(Benchmark& bench, Scratch& scratch)
+    {
+        const std::string file = scratch.path("image.bmp");
+        for(unsigned int bpp : { 8u, 24u, 32u }) {
+            auto image = std::make_shared<BMP>(file, 1920, 1080, bpp);
+            const std::string depth = std::to_string(bpp) + "bpp";
+
+            bench.add("bmp/circle/filled/r100/" + depth, [image](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    image->circle(200 + (unsigned int)(i % 1500), 540, 100, 255, (unsigned char)i, 0, true);
+                }
+            });
+
+            bench.add("bmp/circle/outline/r100/" + depth, [image](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    image->circle(200 + (unsigned int)(i % 1500), 540, 100, 255, (unsigned char)i, 0, false);
+                }
+            });
+
+            bench.add("bmp/square/filled/200x200/" + depth, [image](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    image->square((unsigned int)(i % 1700), 400, 200, 200, 0, 255, (unsigned char)i, true);
+                }
+            });
+
+            bench.add("bmp/line/1000px/" + depth, [image](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    image->line(0, (unsigned int)(i % 1080), 999, 1079 - (unsigned int)(i % 1080), (unsigned char)i, 0, 255);
+                }
+            });
+
+            bench.add("bmp/lineAD/1000px/" + depth, [image](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    image->lineAD(0, 540, (float)(i % 628) / 100.0f - 3.14f, 1000, (unsigned char)i, 255, 0);
+                }
+            });
+
+            bench.add("bmp/write/1920x1080/" + depth, [image](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    image->write();
+                }
+            }, (std::size_t)image->getStride() * 1080);
+        }
+
+        // The same shapes through the old per-pixel code, against the 24 bpp
+        // cases above.
+        auto reference_image = std::make_shared<BMP>(file, 1920, 1080, 24);
+        auto reference = std::make_shared<ReferenceCanvas>(ReferenceCanvas { reference_image->getPixels(), 1920, 1080 });
+        bench.add("bmp/reference/circle/filled/r100/24bpp", [reference_image, reference](std::size_t iterations) {
+            for(std::size_t i = 0; i < iterations; ++i) {
+                reference->circle(200 + (int)(i % 1500), 540, 100, 255, (unsigned char)i, 0, true);
+            }
+        });
+        bench.add("bmp/reference/circle/outline/r100/24bpp", [reference_image, reference](std::size_t iterations) {
+            for(std::size_t i = 0; i < iterations; ++i) {
+                reference->circle(200 + (int)(i % 1500), 540, 100, 255, (unsigned char)i, 0, false);
+            }
+        });
+        bench.add("bmp/reference/line/1000px/24bpp", [reference_image, reference](std::size_t iterations) {
+            for(std::size_t i = 0; i < iterations; ++i) {
+                reference->line(0, (int)(i % 1080), 999, 1079 - (int)(i % 1080), (unsigned char)i, 0, 255);
+            }
+        });
+        bench.add("bmp/reference/lineAD/1000px/24bpp", [reference_image, reference](std::size_t iterations) {
+            for(std::size_t i = 0; i < iterations; ++i) {
+                reference->lineAD(0, 540, (float)(i % 628) / 100.0f - 3.14f, 1000, (unsigned char)i, 255, 0);
+            }
+        });
+
+        // One thousand shapes scattered over the image, drawn serially and in
+        // tiles from a Batch.
+        auto batch = std::make_shared<BMP::Batch>();
+        std::mt19937 generator(3);
+        for(int i = 0; i < 1000; ++i) {
+            unsigned int x = generator() % 1920, y = generator() % 1080;
+            unsigned char c = (unsigned char)generator();
+            switch(i % 3) {
+                case 0: batch->circle(x, y, 10 + generator() % 60, c, 0, 0, i % 2 == 0); break;
+                case 1: batch->square(x, y, 10 + generator() % 120, 10 + generator() % 120, 0, c, 0, i % 2 == 0); break;
+                default: batch->line(x, y, generator() % 1920, generator() % 1080, 0, 0, c); break;
+            }
+        }
+        auto canvas = std::make_shared<BMP>(file, 1920, 1080, 24);
+        for(unsigned int threads : { 1u, 0u }) {
+            bench.add("bmp/draw/1000_shapes/threads=" + (threads == 0 ? std::string("all") : std::to_string(threads)), [canvas, batch, threads](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    canvas->draw(*batch, threads);
+                }
+            });
+        }
+
+        // The 8K scene drawn by direct calls, and from a Batch on one thread
+        // and on all of them. The 192 MB canvas is only built for a selected
+        // case.
+        const std::string large = scratch.path("scene8k.bmp");
+        bench.addWithSetup("bmp/draw/8192x8192/100000_shapes/direct", [large] {
+            auto canvas = std::make_shared<BMP>(large, 8192, 8192, 24);
+            return Benchmark::Function([canvas](std::size_t iterations) {
+                for(std::size_t i = 0; i < iterations; ++i) {
+                    scene8K(*canvas);
+                }
+            });
+        });
+        for(unsigned int threads : { 1u, 0u }) {
+            bench.addWithSetup("bmp/draw/8192x8192/100000_shapes/threads=" + (threads == 0 ? std::string("all") : std::to_string(threads)), [large, threads] {
+                auto canvas = std::make_shared<BMP>(large, 8192, 8192, 24);
+                auto scene = std::make_shared<BMP::Batch>();
+                scene8K(*scene);
+                return Benchmark::Function([canvas, scene, threads](std::size_t iterations) {
+                    for(std::size_t i = 0; i < iterations; ++i) {
+                        canvas->draw(*scene, threads);
+                    }
+                });
+            });
+        }
+
+        const std::string streamed = scratch.path("streamed.bmp");
+        bench.add("bmp/BMPWriter/1920x1080/24bpp", [streamed](std::size_t iterations) {
+            std::vector<unsigned char> row(1920 * 3, 0x7F);
+            for(std::size_t i = 0; i < iterations; ++i) {
+                BMPWriter writer(streamed, 1920, 1080, 24);
+                for(unsigned int y = 0; y < 1080; ++y) {
+                    writer.writeRow(row.data());
+                }
+                writer.close();
+            }
+        }, (std::size_t)1920 * 3 * 1080);
+    }
+
+    // Writes entries settings, or stops at the first line that takes the file
+    // past max_bytes, and returns the size of the file.
+    std::size_t writeConfig(const std::string& file, std::size_t entries, std::size_t max_bytes = std::size_t(-1))
+    {
+        std::ofstream out(file, std::ios::binary);
+        for(std::size_t i = 0; i < entries && (std::size_t)out.tellp() < max_bytes; ++i) {
+            out << "setting_" << i << ":" << (i * 2654435761u) % 100000 << "\n";
+            if(i % 16 == 0) {
+                out << "# comment line " << i << "\n";
+            }
+        }
+        out.flush();
+        return (std::size_t)out.tellp();
+    }
+
+    // Times the three ways to load file at startup. A prepare function makes
+    // the cases lazy: it runs in the setup of a selected case and is expected
+    // to write the file and its cache.
+    void addConfigStartup(Benchmark& bench, const std::string& suffix, const std::string& file, std::size_t bytes, std::function<void()> prepare = nullptr)
+    {
+        auto add = [&](const std::string& name, Benchmark::Function fn) {
+            if(prepare) {
+                bench.addWithSetup(name, [prepare, fn] { prepare(); return fn; }, bytes);
+            } else {
+                bench.add(name, std::move(fn), bytes);
+            }
+        };
+
+        add("config/load_config_file/" + suffix, [file](std::size_t iterations) {
+            for(std::size_t i = 0; i < iterations; ++i) {
+                auto config = load_config_file(file);
+                bench_detail::use(config.size());
+            }
+        });
+
+        add("config/ConfigMap/" + suffix, [file](std::size_t iterations) {
+            for(std::size_t i = 0; i < iterations; ++i) {
+                ConfigMap config(file);
+                bench_detail::use(config.size());
+            }
+        });
+
+        add("config/ConfigCache/" + suffix, [file](std::size_t iterations) {
+            for(std::size_t i = 0; i < iterations; ++i) {
+                ConfigCache config(file);
+                bench_detail::use(config.size());
+            }
+        });
+    }
+
+    void addConfig(Benchmark& bench, Scratch& scratch)
+    {
+        for(std::size_t entries : { std::size_t(64), std::size_t(1) << 16, std::size_t(1) << 20 }) {
+            const std::string file = scratch.path("config_" + std::to_string(entries));
+            const std::size_t bytes = writeConfig(file, entries);
+            scratch.path("config_" + std::to_string(entries) + ".cache");
+            ConfigCache(file).size(); // Build the cache so every timed call maps it
+            addConfigStartup(bench, std::to_string(entries) + "_entries", file, bytes);
+        }
+
+        // A 100 MB file, only written once one of its cases is selected.
+        const std::size_t large_bytes = std::size_t(100) << 20;
+        const std::string large = scratch.path("config_100MB");
+        scratch.path("config_100MB.cache");
+        auto written = std::make_shared<bool>(false);
+        addConfigStartup(bench, "100MB", large, large_bytes, [large, large_bytes, written] {
+            if(!*written) {
+                writeConfig(large, std::size_t(-1), large_bytes);
+                ConfigCache(large).size();
+                *written = true;
+            }
+        });
+
+        const std::string file = scratch.path("config_typed");
+        writeConfig(file, 64);
+        auto config = std::make_shared<Config>(file);
+        auto key = std::make_shared<Config::Key<long long>>(config->key<long long>("setting_7", 0));
+        config->reload();
+        bench.add("config/Config::get", [config, key](std::size_t iterations) {
+            long long sum = 0;
+            for(std::size_t i = 0; i < iterations; ++i) {
+                sum += config->get(*key);
+            }
+            bench_detail::use(sum);
+        });
+
+        auto map = std::make_shared<ConfigMap>(file);
+        bench.add("config/ConfigMap::find", [map](std::size_t iterations) {
+            std::size_t sum = 0;
+            for(std::size_t i = 0; i < iterations; ++i) {
+                sum += map->find("setting_7")->second.size();
+            }
+            bench_detail::use(sum);
+        });
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string filter;
+    std::string json;
+    Benchmark bench;
+
+    for(int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if(arg.rfind("--filter=", 0) == 0) {
+            filter = arg.substr(9);
+        } else if(arg.rfind("--min-time=", 0) == 0) {
+            bench.setMinTime(std::stod(arg.substr(11)));
+        } else if(arg.rfind("--json=", 0) == 0) {
+            json = arg.substr(7);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--filter=substring] [--min-time=seconds] [--json=file]\n";
+            return 2;
+        }
+    }
+
+    try {
+        Scratch scratch;
+        addRadixSort(bench);
+        addWeightedBag(bench);
+        addCSV(bench, scratch);
+        addBMP(bench, scratch);
+        addConfig(bench, scratch);
+
+        auto results = bench.run(filter);
+        Benchmark::writeTable(std::cout, results);
+        if(!bench.perfAvailable()) {
+            std::cout << "(hardware counters unavailable)\n";
+        }
+        if(!json.empty()) {
+            std::ofstream out(json);
+            bench.writeJSON(out, results);
+        }
+    } catch(const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
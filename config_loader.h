@@ -1,55 +1,885 @@
-#include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <sstream>
 #include <utility>
 #include <unordered_map>
-#include <regex>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <variant>
+#include <charconv>
 #include <cctype>
+#include <type_traits>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace config_detail
+{
+    using Entry = std::pair<std::string_view, std::string_view>;
+
+    // Characters kept in keys and values, everything else is dropped. ':' and
+    // '\n' are kept too but split the file, so scan handles them apart.
+    inline bool isPlain(unsigned char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-' || c == '\r';
+    }
+
+#if defined(__SSE2__)
+    // Bit i is set when byte i is plain.
+    inline unsigned int plainMask(__m128i bytes)
+    {
+        const __m128i lower = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+        const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+        __m128i other = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('.')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')));
+        other = _mm_or_si128(other, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('-')));
+        other = _mm_or_si128(other, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r')));
+        return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), other));
+    }
+#endif
+
+    // 64-bit FNV-1a, continuing from hash.
+    inline std::uint64_t hash(std::string_view text, std::uint64_t hash = 0xCBF29CE484222325ull)
+    {
+        for(unsigned char c : text) {
+            hash = (hash ^ c) * 0x100000001B3ull;
+        }
+        return hash;
+    }
+
+    // Slot of a key's hash under a bucket seed, for the perfect hash of
+    // ConfigCache.
+    inline std::uint64_t slot(std::uint64_t hash, std::uint32_t seed)
+    {
+        std::uint64_t z = hash + seed * 0x9E3779B97F4A7C15ull;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // Adds the line [begin, end) of the cleaned text if it is "key:value". As
+    // when the line was split on ':' with getline, a single trailing ':' is
+    // ignored, and there must be exactly one other ':' with text either side.
+    inline void addLine(const char* begin, const char* end, const char* colon, unsigned int colons, std::vector<Entry>& entries)
+    {
+        if(end > begin && end[-1] == ':') {
+            --end;
+            --colons;
+        }
+        if(colons == 1 && colon > begin && colon + 1 < end) {
+            entries.emplace_back(std::string_view(begin, colon - begin), std::string_view(colon + 1, end - colon - 1));
+        }
+    }
+
+    // Copies the characters worth keeping from data to out in one pass and
+    // records the entries of every line as views into out. With SSE2 the text
+    // is classified 16 bytes at a time and the runs of plain characters
+    // between the others are stored whole, which may write up to 16 bytes past
+    // the end of the kept text.
+    inline void scan(const char* data, std::size_t size, char* out, std::vector<Entry>& entries)
+    {
+        const char* line = out;
+        const char* colon = nullptr;
+        unsigned int colons = 0;
+        std::size_t i = 0;
+
+        auto special = [&](char c) {
+            if(c == '\n') {
+                addLine(line, out, colon, colons, entries);
+                line = out;
+                colon = nullptr;
+                colons = 0;
+            } else if(c == ':') {
+                if(colons++ == 0) { colon = out; }
+                *out++ = c;
+            }
+        };
+
+#if defined(__SSE2__)
+        // Runs are loaded from where they start, so keep 32 bytes of input.
+        for(; i + 32 <= size; i += 16) {
+            unsigned int others = ~plainMask(_mm_loadu_si128((const __m128i*)(data + i))) & 0xFFFF;
+            unsigned int start = 0;
+            while(true) {
+                const unsigned int stop = others != 0 ? __builtin_ctz(others) : 16;
+                if(stop > start) {
+                    _mm_storeu_si128((__m128i*)out, _mm_loadu_si128((const __m128i*)(data + i + start)));
+                    out += stop - start;
+                }
+                if(stop == 16) { break; }
+                special(data[i + stop]);
+                start = stop + 1;
+                others &= others - 1;
+            }
+        }
+#endif
+        for(; i < size; ++i) {
+            const char c = data[i];
+            if(isPlain(c)) {
+                *out++ = c;
+            } else {
+                special(c);
+            }
+        }
+        addLine(line, out, colon, colons, entries);
+    }
+}
+
+// Config entries sorted by key, as views into one buffer holding the cleaned
+// file. Follows the same rules as load_config_file, including that the first
+// of several entries with the same key wins.
+class ConfigMap
+{
+public:
+    using Entry = config_detail::Entry;
+    using const_iterator = std::vector<Entry>::const_iterator;
+
+    ConfigMap() = default;
+
+    // Maps the file and scans it straight into the buffer.
+    explicit ConfigMap(const std::string& file_name)
+    {
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        struct stat info;
+        if(fd < 0 || ::fstat(fd, &info) != 0) {
+            if(fd >= 0) { ::close(fd); }
+            throw std::runtime_error("Failed to open the config file: " + file_name);
+        }
+
+        const std::size_t size = info.st_size;
+        if(size == 0) {
+            ::close(fd);
+            return;
+        }
+        void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(data == MAP_FAILED) {
+            throw std::runtime_error("Failed to map the config file: " + file_name + ": " + std::strerror(errno));
+        }
+        ::madvise(data, size, MADV_SEQUENTIAL);
+
+        try {
+            build(static_cast<const char*>(data), size);
+        } catch(...) {
+            ::munmap(data, size);
+            throw;
+        }
+        ::munmap(data, size);
+    }
+
+    static ConfigMap fromString(std::string_view text)
+    {
+        ConfigMap config;
+        config.build(text.data(), text.size());
+        return config;
+    }
+
+    const_iterator find(std::string_view key) const
+    {
+        auto it = std::lower_bound(entries.begin(), entries.end(), key, [](const Entry& entry, std::string_view k) { return entry.first < k; });
+        return it != entries.end() && it->first == key ? it : entries.end();
+    }
+
+    std::size_t count(std::string_view key) const
+    {
+        return find(key) != entries.end() ? 1 : 0;
+    }
+
+    std::string_view at(std::string_view key) const
+    {
+        auto it = find(key);
+        if(it == entries.end()) {
+            throw std::out_of_range("No config entry named " + std::string(key));
+        }
+        return it->second;
+    }
+
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+    std::size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+
+private:
+    void build(const char* data, std::size_t size)
+    {
+        buffer.reset(new char[size + 16]);
+        entries.clear();
+        config_detail::scan(data, size, buffer.get(), entries);
+
+        // Views later in the buffer come from later lines, so ordering equal keys
+        // by address keeps the first one in front for unique.
+        auto before = [](const Entry& a, const Entry& b) {
+            int order = a.first.compare(b.first);
+            return order < 0 || (order == 0 && a.first.data() < b.first.data());
+        };
+        if(!std::is_sorted(entries.begin(), entries.end(), before)) {
+            std::sort(entries.begin(), entries.end(), before);
+        }
+        entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.first == b.first; }), entries.end());
+    }
+
+    std::unique_ptr<char[]> buffer;
+    std::vector<Entry> entries;
+};
 
 inline std::unordered_map<std::string, std::string> load_config_file(const std::string& file_name)
 {
+    ConfigMap config(file_name);
+
     std::unordered_map<std::string, std::string> output;
-    std::ifstream file(file_name);
-
-    if(file.is_open()) {
-
-        // Load in the entire file
-        std::string file_data;
-        file.seekg(0, std::ios::end);
-        unsigned long file_size = file.tellg();
-        file.seekg(0, std::ios::beg);
-        file_data.resize(file_size);
-        file.read((char*)file_data.data(), file_size);
-
-        // Clean the config file of unwanted characters.
-        std::regex good_characters("([^a-zA-Z0-9:._\r\n-]+)");
-        std::istringstream cleaned_file_data;
-        cleaned_file_data.str(std::regex_replace(file_data, good_characters, ""));
-
-        std::string line;
-        while(std::getline(cleaned_file_data, line)) {
-            if(line.find(':') > 0) { // Check to see if a colon exists
-
-                // Explode the line around the colon
-                std::vector<std::string> e;
-                std::istringstream iss(line);
-                for (std::string token; std::getline(iss, token, ':'); ) {
-                    e.push_back(std::move(token));
+    output.reserve(config.size());
+    for(const auto& entry : config) {
+        output.emplace(entry.first, entry.second);
+    }
+    return output;
+}
+
+// Config values parsed once into typed slots. Keys are registered up front and
+// resolve to handles, so a lookup is an index into the current snapshot.
+// Snapshots are immutable. reload() and the watcher publish a new snapshot with
+// one atomic store, and free the old one only after every reader that could
+// still see it has finished. Readers never take a lock: they count themselves
+// in one of two counters around each read, and the writer flips between the
+// counters twice and waits for each to drain, as userspace RCU does. So a
+// thread must not register a key or reload while it holds a Reader.
+class Config
+{
+public:
+    using Value = std::variant<long long, double, bool, std::string>;
+
+    template <typename T>
+    struct Key
+    {
+        static_assert(std::is_same<T, long long>::value || std::is_same<T, double>::value || std::is_same<T, bool>::value || std::is_same<T, std::string>::value,
+            "Config values are long long, double, bool or std::string.");
+        std::size_t index;
+    };
+
+    class Snapshot
+    {
+    public:
+        template <typename T>
+        const T& get(Key<T> key) const
+        {
+            if(key.index >= values.size()) {
+                throw std::out_of_range("Config key was registered after this snapshot was taken.");
+            }
+            return std::get<T>(values[key.index]);
+        }
+
+        // False when the file had no usable value and the fallback is in use.
+        template <typename T>
+        bool isSet(Key<T> key) const
+        {
+            return key.index < set.size() && set[key.index];
+        }
+
+    private:
+        friend class Config;
+        std::vector<Value> values;
+        std::vector<bool> set;
+    };
+
+    // Keeps a snapshot alive for as long as it exists.
+    class Reader
+    {
+    public:
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        Reader(Reader&& other) noexcept : snapshot(other.snapshot), readers(other.readers)
+        {
+            other.readers = nullptr;
+        }
+
+        ~Reader()
+        {
+            if(readers != nullptr) {
+                readers->fetch_sub(1);
+            }
+        }
+
+        const Snapshot& operator*() const { return *snapshot; }
+        const Snapshot* operator->() const { return snapshot; }
+
+    private:
+        friend class Config;
+        Reader(const Snapshot* _snapshot, std::atomic<long>* _readers) : snapshot(_snapshot), readers(_readers) {}
+
+        const Snapshot* snapshot;
+        std::atomic<long>* readers;
+    };
+
+    explicit Config(const std::string& _file_name) : file_name(_file_name), text(_file_name)
+    {
+        modified = stamp();
+        current.store(new Snapshot());
+    }
+
+    Config(const Config&) = delete;
+    Config& operator=(const Config&) = delete;
+
+    ~Config()
+    {
+        stopWatching();
+        delete current.load();
+    }
+
+    // Returns the handle for name, registering it on first use. The value is
+    // fallback when the file lacks the key or its value does not parse as T.
+    template <typename T>
+    Key<T> key(const std::string& name, T fallback = T())
+    {
+        std::lock_guard<std::mutex> lock(writer_m);
+        for(std::size_t i = 0; i < specs.size(); ++i) {
+            if(specs[i].name == name) {
+                if(!std::holds_alternative<T>(specs[i].fallback)) {
+                    throw std::invalid_argument("Config key " + name + " is already registered with another type.");
                 }
+                return Key<T> { i };
+            }
+        }
+
+        specs.push_back(Spec { name, Value(std::move(fallback)) });
+        const Snapshot* old = current.load();
+        Snapshot* next = new Snapshot(*old);
+        next->values.push_back(specs.back().fallback);
+        next->set.push_back(false);
+        resolve(specs.size() - 1, *next);
+        publish(next);
+        return Key<T> { specs.size() - 1 };
+    }
+
+    Reader read() const
+    {
+        std::atomic<long>* counter = &readers[phase.load()];
+        counter->fetch_add(1);
+        return Reader(current.load(), counter);
+    }
+
+    // A copy of one value, for when a single read is all that is needed.
+    template <typename T>
+    T get(Key<T> key) const
+    {
+        return read()->get(key);
+    }
 
-                if(e.size() == 2) { // Check to make sure there is only two elements
-                    if(e.at(0).size() > 0 && e.at(1).size() > 0) { // Check to see if there is something writen on eather side of the colon
-                        output.emplace(e.at(0), e.at(1));
+    // Parses the file again and publishes the result. On failure the current
+    // snapshot stays and false is returned.
+    bool reload()
+    {
+        std::lock_guard<std::mutex> lock(writer_m);
+        try {
+            modified = stamp();
+            ConfigMap fresh(file_name);
+            Snapshot* next = new Snapshot(*current.load());
+            text = std::move(fresh);
+            for(std::size_t i = 0; i < specs.size(); ++i) {
+                resolve(i, *next);
+            }
+            publish(next);
+        } catch(const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    // Checks the file's modification time every interval on a thread of its
+    // own and reloads it when it changes.
+    void watch(std::chrono::milliseconds interval = std::chrono::milliseconds(500))
+    {
+        stopWatching();
+        stopping = false;
+        watcher = std::thread([this, interval]() {
+            std::unique_lock<std::mutex> lock(watch_m);
+            while(!watch_cv.wait_for(lock, interval, [this]() { return stopping; })) {
+                bool changed;
+                {
+                    std::lock_guard<std::mutex> writer_lock(writer_m);
+                    changed = stamp() != modified;
+                }
+                if(changed) {
+                    reload();
+                }
+            }
+        });
+    }
+
+    void stopWatching()
+    {
+        if(watcher.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(watch_m);
+                stopping = true;
+            }
+            watch_cv.notify_one();
+            watcher.join();
+        }
+    }
+
+private:
+    struct Spec
+    {
+        std::string name;
+        Value fallback;
+    };
+
+    // Modification time and size, or -1 when the file cannot be read.
+    std::pair<long long, long long> stamp() const
+    {
+        struct stat info;
+        if(::stat(file_name.c_str(), &info) != 0) {
+            return { -1, -1 };
+        }
+        return { (long long)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec, (long long)info.st_size };
+    }
+
+    // Parses the file's value for spec i into the snapshot, falling back when
+    // it is missing or malformed. A trailing CR from a CRLF file is ignored.
+    void resolve(std::size_t i, Snapshot& snapshot) const
+    {
+        snapshot.values[i] = specs[i].fallback;
+        snapshot.set[i] = false;
+
+        auto it = text.find(specs[i].name);
+        if(it == text.end()) { return; }
+        std::string_view value = it->second;
+        if(!value.empty() && value.back() == '\r') {
+            value.remove_suffix(1);
+        }
+
+        const char* first = value.data();
+        const char* last = value.data() + value.size();
+        Value parsed;
+        bool ok = false;
+        if(std::holds_alternative<long long>(specs[i].fallback)) {
+            long long number;
+            auto result = std::from_chars(first, last, number);
+            ok = result.ec == std::errc() && result.ptr == last;
+            parsed = number;
+        } else if(std::holds_alternative<double>(specs[i].fallback)) {
+            // from_chars ignores the locale, unlike strtod, and needs no copy
+            double number;
+            auto result = std::from_chars(first, last, number);
+            ok = result.ec == std::errc() && result.ptr == last;
+            parsed = number;
+        } else if(std::holds_alternative<bool>(specs[i].fallback)) {
+            std::string lower(value);
+            std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+            ok = lower == "true" || lower == "yes" || lower == "on" || lower == "1" ||
+                lower == "false" || lower == "no" || lower == "off" || lower == "0";
+            parsed = lower == "true" || lower == "yes" || lower == "on" || lower == "1";
+        } else {
+            ok = true;
+            parsed = std::string(value);
+        }
+
+        if(ok) {
+            snapshot.values[i] = std::move(parsed);
+            snapshot.set[i] = true;
+        }
+    }
+
+    // Swaps in the new snapshot, waits out the readers of the old one and
+    // frees it. Called with writer_m held.
+    void publish(Snapshot* next)
+    {
+        const Snapshot* old = current.exchange(next);
+        for(int flip = 0; flip < 2; ++flip) {
+            const unsigned int waiting = phase.fetch_xor(1);
+            while(readers[waiting].load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+        delete old;
+    }
+
+    std::string file_name;
+    ConfigMap text;
+    std::vector<Spec> specs;
+    std::pair<long long, long long> modified;
+
+    std::atomic<const Snapshot*> current { nullptr };
+    mutable std::atomic<unsigned int> phase { 0 };
+    mutable std::atomic<long> readers[2] { { 0 }, { 0 } };
+    std::mutex writer_m;
+
+    std::thread watcher;
+    std::mutex watch_m;
+    std::condition_variable watch_cv;
+    bool stopping { false };
+};
+
+// The entries of a config file compiled into a binary image that is mapped
+// instead of parsed. The image sits next to the file (name + ".cache" unless
+// told otherwise) and records the file's modification time, size and inode,
+// which are all that is checked on load. With verify set, the file's contents
+// are hashed and compared too. A stale, truncated or missing image is rebuilt
+// from the text. When it cannot be written, the image is kept in memory.
+//
+// Layout: header, entries sorted by key (offset and length of key and value in
+// the string pool), perfect hash index, string pool. The index is built by
+// hash and displace: keys hash to a bucket, and each bucket stores the seed
+// that moves all of its keys to free slots, so a lookup hashes twice and
+// compares one key.
+class ConfigCache
+{
+public:
+    using Entry = config_detail::Entry;
+
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Entry;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Entry*;
+        using reference = Entry;
+
+        Entry operator*() const { return cache->entry(index); }
+        const_iterator& operator++() { ++index; return *this; }
+        const_iterator operator++(int) { const_iterator old = *this; ++index; return old; }
+        bool operator==(const const_iterator& other) const { return index == other.index; }
+        bool operator!=(const const_iterator& other) const { return index != other.index; }
+
+    private:
+        friend class ConfigCache;
+        const_iterator(const ConfigCache* _cache, std::uint32_t _index) : cache(_cache), index(_index) {}
+
+        const ConfigCache* cache;
+        std::uint32_t index;
+    };
+
+    explicit ConfigCache(const std::string& _file_name, const std::string& _cache_name = "", bool verify = false) :
+        file_name(_file_name), cache_name(_cache_name.empty() ? _file_name + ".cache" : _cache_name)
+    {
+        struct stat info;
+        if(::stat(file_name.c_str(), &info) != 0) {
+            throw std::runtime_error("Failed to open the config file: " + file_name);
+        }
+        const Stamp stamp { (std::uint64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec, (std::uint64_t)info.st_size, (std::uint64_t)info.st_ino };
+
+        if(map() && matches(stamp) && (!verify || header()->source_hash == hashFile())) {
+            cached = true;
+            return;
+        }
+        unmap();
+
+        owned = compile(ConfigMap(file_name), stamp, hashFile());
+        if(store() && map()) {
+            if(matches(stamp)) {
+                std::vector<char>().swap(owned);
+                return;
+            }
+            unmap();
+        }
+        image = owned.data();
+        image_size = owned.size();
+    }
+
+    ConfigCache(const ConfigCache&) = delete;
+    ConfigCache& operator=(const ConfigCache&) = delete;
+
+    ~ConfigCache()
+    {
+        unmap();
+    }
+
+    const_iterator find(std::string_view key) const
+    {
+        const Header* h = header();
+        if(h->count == 0) { return end(); }
+
+        const std::uint64_t hash = config_detail::hash(key);
+        const std::uint32_t* seeds = reinterpret_cast<const std::uint32_t*>(image + h->seeds_offset);
+        const std::uint32_t* slots = reinterpret_cast<const std::uint32_t*>(image + h->slots_offset);
+        const std::uint32_t seed = seeds[hash % h->bucket_count];
+        const std::uint32_t index = slots[config_detail::slot(hash, seed) % h->slot_count];
+        if(index < h->count && entry(index).first == key) {
+            return const_iterator(this, index);
+        }
+        return end();
+    }
+
+    std::size_t count(std::string_view key) const
+    {
+        return find(key) != end() ? 1 : 0;
+    }
+
+    std::string_view at(std::string_view key) const
+    {
+        auto it = find(key);
+        if(it == end()) {
+            throw std::out_of_range("No config entry named " + std::string(key));
+        }
+        return (*it).second;
+    }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, header()->count); }
+    std::size_t size() const { return header()->count; }
+    bool empty() const { return size() == 0; }
+
+    // Whether the image came from the cache file rather than from the text.
+    bool fromCache() const
+    {
+        return cached;
+    }
+
+private:
+    static constexpr char magic[4] { 'C', 'F', 'G', 'C' };
+    static constexpr std::uint32_t version { 1 };
+
+    struct Stamp
+    {
+        std::uint64_t mtime;
+        std::uint64_t size;
+        std::uint64_t inode;
+    };
+
+    struct Header
+    {
+        char magic[4];
+        std::uint32_t version;
+        Stamp source;
+        std::uint64_t source_hash;
+        std::uint64_t image_size;
+        std::uint32_t count;
+        std::uint32_t bucket_count;
+        std::uint32_t slot_count;
+        std::uint32_t entries_offset;
+        std::uint32_t seeds_offset;
+        std::uint32_t slots_offset;
+        std::uint32_t pool_offset;
+        std::uint32_t pool_size;
+    };
+
+    struct Record
+    {
+        std::uint32_t key_offset;
+        std::uint32_t key_length;
+        std::uint32_t value_offset;
+        std::uint32_t value_length;
+    };
+
+    const Header* header() const
+    {
+        return reinterpret_cast<const Header*>(image);
+    }
+
+    // Entries past the end of the pool, which only a damaged image can have,
+    // come back empty.
+    Entry entry(std::uint32_t index) const
+    {
+        const Header* h = header();
+        Record record;
+        std::memcpy(&record, image + h->entries_offset + (std::size_t)index * sizeof(Record), sizeof(Record));
+        const char* pool = image + h->pool_offset;
+        auto view = [&](std::uint32_t offset, std::uint32_t length) {
+            return (std::uint64_t)offset + length <= h->pool_size ? std::string_view(pool + offset, length) : std::string_view();
+        };
+        return Entry(view(record.key_offset, record.key_length), view(record.value_offset, record.value_length));
+    }
+
+    // Checks everything a lookup relies on without touching the entries.
+    bool matches(const Stamp& stamp) const
+    {
+        if(image_size < sizeof(Header)) { return false; }
+        const Header* h = header();
+        const std::uint64_t n = h->count;
+        return std::memcmp(h->magic, magic, 4) == 0 && h->version == version && h->image_size == image_size &&
+            h->source.mtime == stamp.mtime && h->source.size == stamp.size && h->source.inode == stamp.inode &&
+            h->entries_offset >= sizeof(Header) && h->entries_offset + n * sizeof(Record) <= h->seeds_offset &&
+            (n == 0 || h->bucket_count > 0) && h->seeds_offset + (std::uint64_t)h->bucket_count * 4 <= h->slots_offset &&
+            (n == 0 || h->slot_count >= n) && h->slots_offset + (std::uint64_t)h->slot_count * 4 <= h->pool_offset &&
+            (std::uint64_t)h->pool_offset + h->pool_size <= image_size;
+    }
+
+    std::uint64_t hashFile() const
+    {
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw std::runtime_error("Failed to open the config file: " + file_name);
+        }
+        std::uint64_t hash = config_detail::hash(std::string_view());
+        std::vector<char> chunk(1 << 16);
+        ssize_t n;
+        while((n = ::read(fd, chunk.data(), chunk.size())) > 0 || (n < 0 && errno == EINTR)) {
+            if(n > 0) {
+                hash = config_detail::hash(std::string_view(chunk.data(), n), hash);
+            }
+        }
+        ::close(fd);
+        return hash;
+    }
+
+    static void align(std::vector<char>& out)
+    {
+        out.resize((out.size() + 7) & ~(std::size_t)7);
+    }
+
+    template <typename T>
+    static void put(std::vector<char>& out, std::size_t offset, const T& value)
+    {
+        std::memcpy(out.data() + offset, &value, sizeof(T));
+    }
+
+    static std::vector<char> compile(const ConfigMap& text, const Stamp& stamp, std::uint64_t source_hash)
+    {
+        const std::uint32_t n = text.size();
+        Header h {};
+        std::memcpy(h.magic, magic, 4);
+        h.version = version;
+        h.source = stamp;
+        h.source_hash = source_hash;
+        h.count = n;
+        h.bucket_count = n / 4 + 1;
+        h.slot_count = n + n / 4 + 1;
+
+        std::vector<std::uint64_t> hashes;
+        hashes.reserve(n);
+        for(const auto& entry : text) {
+            hashes.push_back(config_detail::hash(entry.first));
+        }
+
+        // Place the fullest buckets first while most slots are still free.
+        std::vector<std::vector<std::uint32_t>> buckets(h.bucket_count);
+        for(std::uint32_t i = 0; i < n; ++i) {
+            buckets[hashes[i] % h.bucket_count].push_back(i);
+        }
+        std::vector<std::uint32_t> order(h.bucket_count);
+        for(std::uint32_t b = 0; b < h.bucket_count; ++b) { order[b] = b; }
+        std::stable_sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+        std::vector<std::uint32_t> seeds(h.bucket_count, 0);
+        std::vector<std::uint32_t> slots(h.slot_count, UINT32_MAX);
+        std::vector<std::uint32_t> taken;
+        for(std::uint32_t b : order) {
+            if(buckets[b].empty()) { break; }
+            for(std::uint32_t seed = 1;; ++seed) {
+                if(seed == 0) {
+                    throw std::runtime_error("Could not build the config cache index.");
+                }
+                taken.clear();
+                for(std::uint32_t i : buckets[b]) {
+                    const std::uint32_t s = config_detail::slot(hashes[i], seed) % h.slot_count;
+                    if(slots[s] != UINT32_MAX || std::find(taken.begin(), taken.end(), s) != taken.end()) { break; }
+                    taken.push_back(s);
+                }
+                if(taken.size() == buckets[b].size()) {
+                    for(std::size_t k = 0; k < taken.size(); ++k) {
+                        slots[taken[k]] = buckets[b][k];
                     }
+                    seeds[b] = seed;
+                    break;
                 }
             }
         }
-    } else {
-        throw std::runtime_error("Failed to open the config file: " + file_name);
+
+        std::vector<char> out(sizeof(Header));
+        h.entries_offset = out.size();
+        out.resize(out.size() + (std::size_t)n * sizeof(Record));
+        align(out);
+        h.seeds_offset = out.size();
+        out.insert(out.end(), (const char*)seeds.data(), (const char*)(seeds.data() + seeds.size()));
+        align(out);
+        h.slots_offset = out.size();
+        out.insert(out.end(), (const char*)slots.data(), (const char*)(slots.data() + slots.size()));
+        align(out);
+        h.pool_offset = out.size();
+
+        std::uint32_t i = 0;
+        for(const auto& entry : text) {
+            Record record;
+            record.key_offset = out.size() - h.pool_offset;
+            record.key_length = entry.first.size();
+            out.insert(out.end(), entry.first.begin(), entry.first.end());
+            record.value_offset = out.size() - h.pool_offset;
+            record.value_length = entry.second.size();
+            out.insert(out.end(), entry.second.begin(), entry.second.end());
+            put(out, h.entries_offset + (std::size_t)i++ * sizeof(Record), record);
+        }
+        if(out.size() > UINT32_MAX) {
+            throw std::runtime_error("Config file is too large to cache.");
+        }
+        h.pool_size = out.size() - h.pool_offset;
+        h.image_size = out.size();
+        put(out, 0, h);
+        return out;
     }
-    return output;
-}
+
+    // Writes the image to a temporary file and renames it into place, so a
+    // reader never maps a half written cache.
+    bool store() const
+    {
+        const std::string temporary = cache_name + "." + std::to_string(::getpid()) + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) { return false; }
+
+        std::size_t written = 0;
+        while(written < owned.size()) {
+            ssize_t n = ::write(fd, owned.data() + written, owned.size() - written);
+            if(n < 0 && errno == EINTR) { continue; }
+            if(n <= 0) { break; }
+            written += n;
+        }
+        if(::close(fd) != 0 || written != owned.size() || std::rename(temporary.c_str(), cache_name.c_str()) != 0) {
+            ::unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool map()
+    {
+        int fd = ::open(cache_name.c_str(), O_RDONLY);
+        if(fd < 0) { return false; }
+        struct stat info;
+        if(::fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(Header)) {
+            ::close(fd);
+            return false;
+        }
+        void* data = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(data == MAP_FAILED) { return false; }
+        mapping = data;
+        image = static_cast<const char*>(data);
+        image_size = info.st_size;
+        return true;
+    }
+
+    void unmap()
+    {
+        if(mapping != nullptr) {
+            ::munmap(mapping, image_size);
+            mapping = nullptr;
+        }
+        image = nullptr;
+        image_size = 0;
+    }
+
+    std::string file_name;
+    std::string cache_name;
+    std::vector<char> owned;
+    void* mapping { nullptr };
+    const char* image { nullptr };
+    std::size_t image_size { 0 };
+    bool cached { false };
+};
 
 /*
 
@@ -66,4 +896,24 @@ config["name1"]
 The value will be in a string and can be converted to whatever value you wish.
 There is obviously no type verifying. USE AT YOUR OWN RISK.
 
+To skip the copies, ConfigMap gives the same entries as string_views sorted by
+name, with find, at and count:
+
+ConfigMap config("config");
+std::string_view value = config.at("name1");
+
+For typed values that follow the file as it changes, register the keys once
+and read them through their handles:
+
+Config config("config");
+auto threads = config.key<long long>("threads", 4);
+config.watch();
+long long n = config.get(threads);
+
+To skip parsing altogether when the file has not changed since the last run,
+load it through its compiled cache:
+
+ConfigCache config("config");
+std::string_view value = config.at("name1");
+
 */
\ No newline at end of file
@@ -1,10 +1,709 @@
 #include <map>
 #include <string>
+#include <string_view>
 #include <fstream>
-#include <sstream>
 #include <exception>
+#include <stdexcept>
 #include <mutex>
 #include <vector>
+#include <thread>
+#include <algorithm>
+#include <iterator>
+#include <cerrno>
+#include <climits>
+#include <memory>
+#include <condition_variable>
+#include <initializer_list>
+#include <type_traits>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <charconv>
+#include <cmath>
+#include <functional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Finds the structural characters of a CSV buffer (delimiters and newlines that
+// are not inside a quoted field) 64 bytes at a time. Each block is classified
+// into bitmasks with the widest instruction set the CPU supports, then quoted
+// regions are removed with a prefix xor over the quote mask.
+class CSVScanner
+{
+public:
+    struct Masks
+    {
+        std::uint64_t delimiter { 0 };
+        std::uint64_t quote     { 0 };
+        std::uint64_t newline   { 0 };
+    };
+
+    CSVScanner(char _delimiter = ',') : delimiter(_delimiter), classifier(selectClassifier()) {}
+
+    char getDelimiter() const
+    {
+        return delimiter;
+    }
+
+    void classify(const char* block, Masks& masks) const
+    {
+        classifier(block, delimiter, masks);
+    }
+
+    // Calls fn(position, is_newline) for every delimiter and newline in
+    // [data, data + size) that lies outside a quoted field. in_quotes is the quote
+    // state at data, the state at the end of the buffer is returned.
+    template <typename F>
+    bool scan(const char* data, std::size_t size, bool in_quotes, F&& fn) const
+    {
+        std::uint64_t carry = in_quotes ? ~0ull : 0ull;
+        for(std::size_t base = 0; base < size; base += 64) {
+            std::uint64_t newlines;
+            std::uint64_t structural = structurals(data, size, base, carry, newlines);
+            while(structural != 0) {
+                unsigned int bit = __builtin_ctzll(structural);
+                fn(base + bit, ((newlines >> bit) & 1) != 0);
+                structural &= structural - 1;
+            }
+        }
+        return carry != 0;
+    }
+
+    // Position of the first newline outside a quoted field, or size if there is none.
+    std::size_t findNewline(const char* data, std::size_t size, bool in_quotes) const
+    {
+        std::uint64_t carry = in_quotes ? ~0ull : 0ull;
+        for(std::size_t base = 0; base < size; base += 64) {
+            std::uint64_t newlines;
+            std::uint64_t structural = structurals(data, size, base, carry, newlines) & newlines;
+            if(structural != 0) {
+                return base + __builtin_ctzll(structural);
+            }
+        }
+        return size;
+    }
+
+    std::size_t countQuotes(const char* data, std::size_t size) const
+    {
+        std::size_t count = 0;
+        Masks masks;
+        for(std::size_t base = 0; base < size; base += 64) {
+            load(data, size, base, masks);
+            count += __builtin_popcountll(masks.quote);
+        }
+        return count;
+    }
+
+    // Collapses every "" in a quoted field to ". dst may equal src.
+    static std::uint32_t unescape(const char* src, std::size_t size, char* dst)
+    {
+        std::size_t length = 0;
+        for(std::size_t i = 0; i < size; ++i) {
+            dst[length++] = src[i];
+            if(src[i] == '"' && i + 1 < size && src[i + 1] == '"') { i++; }
+        }
+        return length;
+    }
+
+    // Bit i of the result is the xor of bits 0..i of x, so it is set for every
+    // byte between an opening quote and its closing quote. Escaped quotes ("")
+    // toggle twice and cancel out.
+    static std::uint64_t prefixXor(std::uint64_t x)
+    {
+        x ^= x << 1;
+        x ^= x << 2;
+        x ^= x << 4;
+        x ^= x << 8;
+        x ^= x << 16;
+        x ^= x << 32;
+        return x;
+    }
+
+private:
+    using Classifier = void (*)(const char*, char, Masks&);
+
+    // Classifies the block at data + base, zero padding a final partial block.
+    void load(const char* data, std::size_t size, std::size_t base, Masks& masks) const
+    {
+        if(size - base >= 64) {
+            classify(data + base, masks);
+        } else {
+            char tail[64] = { 0 };
+            std::memcpy(tail, data + base, size - base);
+            classify(tail, masks);
+            std::uint64_t valid = (1ull << (size - base)) - 1;
+            masks.delimiter &= valid;
+            masks.quote &= valid;
+            masks.newline &= valid;
+        }
+    }
+
+    // Unquoted delimiters and newlines of the block at data + base. carry is all
+    // ones while inside a quoted field and is updated for the next block.
+    std::uint64_t structurals(const char* data, std::size_t size, std::size_t base, std::uint64_t& carry, std::uint64_t& newlines) const
+    {
+        Masks masks;
+        load(data, size, base, masks);
+
+        std::uint64_t inside = prefixXor(masks.quote) ^ carry;
+        carry = static_cast<std::uint64_t>(static_cast<std::int64_t>(inside) >> 63);
+
+        newlines = masks.newline & ~inside;
+        return (masks.delimiter | masks.newline) & ~inside;
+    }
+
+    static void classifyScalar(const char* block, char delimiter, Masks& masks)
+    {
+        std::uint64_t d = 0, q = 0, n = 0;
+        for(unsigned int i = 0; i < 64; ++i) {
+            d |= static_cast<std::uint64_t>(block[i] == delimiter) << i;
+            q |= static_cast<std::uint64_t>(block[i] == '"') << i;
+            n |= static_cast<std::uint64_t>(block[i] == '\n') << i;
+        }
+        masks.delimiter = d;
+        masks.quote = q;
+        masks.newline = n;
+    }
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    static void classifySSE2(const char* block, char delimiter, Masks& masks)
+    {
+        const __m128i d = _mm_set1_epi8(delimiter);
+        const __m128i q = _mm_set1_epi8('"');
+        const __m128i n = _mm_set1_epi8('\n');
+        masks = Masks();
+        for(unsigned int i = 0; i < 4; ++i) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i * 16));
+            masks.delimiter |= static_cast<std::uint64_t>(static_cast<std::uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, d)))) << (i * 16);
+            masks.quote |= static_cast<std::uint64_t>(static_cast<std::uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, q)))) << (i * 16);
+            masks.newline |= static_cast<std::uint64_t>(static_cast<std::uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, n)))) << (i * 16);
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void classifyAVX2(const char* block, char delimiter, Masks& masks)
+    {
+        const __m256i d = _mm256_set1_epi8(delimiter);
+        const __m256i q = _mm256_set1_epi8('"');
+        const __m256i n = _mm256_set1_epi8('\n');
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+        masks.delimiter = equalMaskAVX2(lo, hi, d);
+        masks.quote = equalMaskAVX2(lo, hi, q);
+        masks.newline = equalMaskAVX2(lo, hi, n);
+    }
+
+    __attribute__((target("avx2")))
+    static std::uint64_t equalMaskAVX2(__m256i lo, __m256i hi, __m256i c)
+    {
+        std::uint64_t low = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, c)));
+        std::uint64_t high = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, c)));
+        return low | (high << 32);
+    }
+
+    static Classifier selectClassifier()
+    {
+        static const Classifier selected = __builtin_cpu_supports("avx2") ? &classifyAVX2 : &classifySSE2;
+        return selected;
+    }
+#else
+    static Classifier selectClassifier()
+    {
+        return &classifyScalar;
+    }
+#endif
+
+    char delimiter;
+    Classifier classifier;
+};
+
+// Reads a CSV file one record at a time through a fixed buffer that only grows
+// to fit the longest record, so files of any size can be filtered or aggregated
+// in bounded memory. Records follow the same RFC 4180 rules as CSV::read().
+//
+//     CSVReader reader("data.csv");
+//     for(const auto& row : reader) { ... }
+//
+// The views in a row point into the reader's buffer and are only valid until
+// the next row is read.
+class CSVReader
+{
+public:
+    using Row = std::vector<std::string_view>;
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type        = Row;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const Row*;
+        using reference         = const Row&;
+
+        iterator() = default;
+
+        explicit iterator(CSVReader* _reader) : reader(_reader)
+        {
+            ++(*this);
+        }
+
+        reference operator*() const
+        {
+            return reader->row;
+        }
+
+        pointer operator->() const
+        {
+            return &reader->row;
+        }
+
+        iterator& operator++()
+        {
+            if(!reader->next()) {
+                reader = nullptr;
+            }
+            return *this;
+        }
+
+        bool operator==(const iterator& o) const
+        {
+            return reader == o.reader;
+        }
+
+        bool operator!=(const iterator& o) const
+        {
+            return reader != o.reader;
+        }
+
+    private:
+        CSVReader* reader { nullptr };
+    };
+
+    CSVReader(const std::string& file_name, std::size_t buffer_size = 1 << 16) : buffer(std::max<std::size_t>(buffer_size, 64))
+    {
+        fd = ::open(file_name.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw std::runtime_error(file_name + " could not be opened for reading.");
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    CSVReader(const CSVReader&) = delete;
+    CSVReader& operator=(const CSVReader&) = delete;
+
+    ~CSVReader()
+    {
+        ::close(fd);
+    }
+
+    // Reads the next record into getRow(). Returns false at the end of the file.
+    bool next()
+    {
+        for(;;) {
+            std::size_t length = tail - head;
+            std::size_t newline = scanner.findNewline(buffer.data() + head, length, false);
+            if(newline < length) {
+                split(head, head + newline);
+                head += newline + 1;
+                return true;
+            }
+            if(eof) {
+                if(length == 0) { return false; }
+                split(head, tail);
+                head = tail;
+                return true;
+            }
+            fill();
+        }
+    }
+
+    const Row& getRow() const
+    {
+        return row;
+    }
+
+    // Index of the current record, counting from zero.
+    unsigned int getRowNumber() const
+    {
+        return row_number - 1;
+    }
+
+    // Calls fn(row) for every remaining record.
+    template <typename F>
+    void forEach(F&& fn)
+    {
+        while(next()) {
+            fn(static_cast<const Row&>(row));
+        }
+    }
+
+    iterator begin()
+    {
+        return iterator(this);
+    }
+
+    iterator end()
+    {
+        return iterator();
+    }
+
+private:
+    // Moves the unread bytes to the front of the buffer, doubling it when a
+    // single record fills it, and reads more of the file behind them.
+    void fill()
+    {
+        std::size_t length = tail - head;
+        if(head > 0) {
+            std::memmove(buffer.data(), buffer.data() + head, length);
+            head = 0;
+            tail = length;
+        }
+        if(tail == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+
+        ssize_t n;
+        do {
+            n = ::read(fd, buffer.data() + tail, buffer.size() - tail);
+        } while(n < 0 && errno == EINTR);
+
+        if(n < 0) {
+            throw std::runtime_error("Failed to read from the CSV file.");
+        }
+        if(n == 0) {
+            eof = true;
+        }
+        tail += n;
+    }
+
+    // Splits the record in [first, last) into row, unquoting fields in place.
+    void split(std::size_t first, std::size_t last)
+    {
+        row.clear();
+        row_number++;
+
+        char* data = buffer.data();
+        if(last > first && data[last - 1] == '\r') { last--; }
+        if(last == first) { return; } // Blank lines become rows without cells
+
+        std::size_t start = first;
+        scanner.scan(data + first, last - first, false, [&](std::size_t offset, bool) {
+            addField(start, first + offset);
+            start = first + offset + 1;
+        });
+        addField(start, last);
+    }
+
+    void addField(std::size_t first, std::size_t last)
+    {
+        char* data = buffer.data();
+        if(last > first && data[first] == '"') {
+            first++;
+            if(last > first && data[last - 1] == '"') { last--; }
+            if(std::memchr(data + first, '"', last - first) != nullptr) {
+                last = first + CSVScanner::unescape(data + first, last - first, data + first);
+            }
+        }
+        row.emplace_back(data + first, last - first);
+    }
+
+    int fd { -1 };
+    std::vector<char> buffer;
+    std::size_t head        { 0 };
+    std::size_t tail        { 0 };
+    bool eof                { false };
+    unsigned int row_number { 0 };
+    Row row;
+    CSVScanner scanner;
+};
+
+// Writes CSV records through large reusable buffers that are handed to the
+// kernel with write(2), or with writev(2) when several are pending. Fields are
+// quoted and escaped per RFC 4180 only when they need it. Rows can be written
+// one at a time, which suits logging.
+//
+// With async enabled full buffers are written by a background thread while the
+// producer keeps formatting into a spare one, so it only waits on the disk when
+// max_pending buffers are already queued. Buffers are recycled, so steady state
+// writing does not allocate. A writer must only be used by one thread at a time.
+class CSVWriter
+{
+public:
+    CSVWriter(const std::string& file_name, bool async = false, std::size_t _buffer_size = 1 << 20) : buffer_size(std::max<std::size_t>(_buffer_size, 64))
+    {
+        fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            throw std::runtime_error(file_name + " could not be opened for writing.");
+        }
+        active = Buffer(buffer_size);
+        iov.reserve(max_pending);
+        pending.reserve(max_pending);
+        if(async) {
+            flusher = std::thread([this]() { flushLoop(); });
+        }
+    }
+
+    CSVWriter(const CSVWriter&) = delete;
+    CSVWriter& operator=(const CSVWriter&) = delete;
+
+    ~CSVWriter()
+    {
+        try {
+            close();
+        } catch(...) {
+        }
+    }
+
+    void writeField(std::string_view field)
+    {
+        if(row_fields > 0) {
+            reserve(1);
+            active.data[active.size++] = delimiter;
+        }
+        row_fields++;
+
+        // Copy the field as is while looking for characters that need quoting,
+        // and redo it quoted in the rare case that there were some.
+        reserve(field.size() * 2 + 2);
+        char* out = active.data.get() + active.size;
+        bool special = false;
+        for(char c : field) {
+            *out++ = c;
+            special |= (c == delimiter) | (c == '"') | (c == '\n') | (c == '\r');
+        }
+
+        if(special) {
+            out = active.data.get() + active.size;
+            *out++ = '"';
+            for(char c : field) {
+                *out++ = c;
+                if(c == '"') { *out++ = '"'; }
+            }
+            *out++ = '"';
+        }
+        active.size = out - active.data.get();
+    }
+
+    void endRow()
+    {
+        reserve(1);
+        active.data[active.size++] = '\n';
+        row_fields = 0;
+    }
+
+    // Writes a whole row from any range of values convertible to std::string_view.
+    template <typename Range>
+    void writeRow(const Range& row)
+    {
+        for(const auto& field : row) {
+            writeField(field);
+        }
+        endRow();
+    }
+
+    void writeRow(std::initializer_list<std::string_view> row)
+    {
+        for(std::string_view field : row) {
+            writeField(field);
+        }
+        endRow();
+    }
+
+    // Blocks until everything written so far has reached the file.
+    void flush()
+    {
+        if(active.size > 0) {
+            submit();
+        }
+        if(flusher.joinable()) {
+            std::unique_lock<std::mutex> lock(queue_m);
+            idle_cv.wait(lock, [this]() { return pending.empty() && !writing; });
+        }
+        if(!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+
+    void close()
+    {
+        if(fd < 0) { return; }
+        try {
+            flush();
+        } catch(...) {
+            shutdown();
+            throw;
+        }
+        shutdown();
+    }
+
+private:
+    struct Buffer
+    {
+        std::unique_ptr<char[]> data;
+        std::size_t size     { 0 };
+        std::size_t capacity { 0 };
+
+        Buffer() = default;
+        Buffer(std::size_t _capacity) : data(new char[_capacity]), capacity(_capacity) {}
+    };
+
+    // Makes room for extra bytes in the active buffer. A full buffer is handed
+    // off even in the middle of a row, only a field larger than a whole buffer
+    // makes it grow.
+    void reserve(std::size_t extra)
+    {
+        if(active.size + extra <= active.capacity) { return; }
+        if(active.size > 0) {
+            submit();
+            if(extra <= active.capacity) { return; }
+        }
+        active = Buffer(extra);
+    }
+
+    void submit()
+    {
+        if(!flusher.joinable()) {
+            writeAll(&active, 1);
+            active.size = 0;
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(queue_m);
+        space_cv.wait(lock, [this]() { return pending.size() < max_pending; });
+        pending.push_back(std::move(active));
+        if(!spare.empty()) {
+            active = std::move(spare.back());
+            spare.pop_back();
+        } else {
+            active = Buffer(buffer_size);
+        }
+        lock.unlock();
+        work_cv.notify_one();
+    }
+
+    void flushLoop()
+    {
+        std::vector<Buffer> batch;
+        batch.reserve(max_pending);
+        std::unique_lock<std::mutex> lock(queue_m);
+        for(;;) {
+            work_cv.wait(lock, [this]() { return !pending.empty() || stopping; });
+            if(pending.empty()) { return; }
+
+            batch.swap(pending);
+            writing = true;
+            lock.unlock();
+            space_cv.notify_all();
+
+            std::string failure;
+            try {
+                writeAll(batch.data(), batch.size());
+            } catch(const std::exception& e) {
+                failure = e.what();
+            }
+
+            lock.lock();
+            for(auto& buffer : batch) {
+                buffer.size = 0;
+                spare.push_back(std::move(buffer));
+            }
+            batch.clear();
+            if(!failure.empty() && error.empty()) { error = failure; }
+            writing = false;
+            idle_cv.notify_all();
+        }
+    }
+
+    // Writes the buffers in order, a single one with write() and a batch with
+    // writev() into an iovec list reserved for a full batch, so flushing does
+    // not allocate. Only one thread flushes at a time: the producer without
+    // async, the flusher thread with it.
+    void writeAll(Buffer* buffers, std::size_t count)
+    {
+        if(count == 1) {
+            writeFully(buffers[0].data.get(), buffers[0].size);
+            return;
+        }
+
+        iov.clear();
+        for(std::size_t i = 0; i < count; ++i) {
+            if(buffers[i].size > 0) {
+                iov.push_back(iovec { buffers[i].data.get(), buffers[i].size });
+            }
+        }
+
+        std::size_t first = 0;
+        while(first < iov.size()) {
+            ssize_t n = ::writev(fd, iov.data() + first, std::min<std::size_t>(iov.size() - first, IOV_MAX));
+            if(n < 0 && errno == EINTR) { continue; }
+            if(n < 0) { fail(); }
+            std::size_t written = n;
+            while(first < iov.size() && written >= iov[first].iov_len) {
+                written -= iov[first].iov_len;
+                first++;
+            }
+            if(first < iov.size()) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+                iov[first].iov_len -= written;
+            }
+        }
+    }
+
+    void writeFully(const char* data, std::size_t size)
+    {
+        while(size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if(n < 0 && errno == EINTR) { continue; }
+            if(n < 0) { fail(); }
+            data += n;
+            size -= n;
+        }
+    }
+
+    [[noreturn]] static void fail()
+    {
+        throw std::runtime_error(std::string("Failed to write the CSV file: ") + std::strerror(errno));
+    }
+
+    void shutdown()
+    {
+        if(flusher.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(queue_m);
+                stopping = true;
+            }
+            work_cv.notify_one();
+            flusher.join();
+        }
+        ::close(fd);
+        fd = -1;
+    }
+
+    static constexpr std::size_t max_pending { 4 };
+
+    int fd { -1 };
+    char delimiter { ',' };
+    std::size_t buffer_size;
+    std::size_t row_fields { 0 };
+    Buffer active;
+    std::vector<iovec> iov;
+    std::vector<Buffer> pending; // Taken whole by the flusher, so never popped
+    std::vector<Buffer> spare;
+    std::string error;
+    bool writing  { false };
+    bool stopping { false };
+    std::mutex queue_m;
+    std::condition_variable work_cv;
+    std::condition_variable space_cv;
+    std::condition_variable idle_cv;
+    std::thread flusher;
+};
 
 class CSV
 {
@@ -13,214 +712,1291 @@ public:
     {
         INOUT = 0,
         IN,
-        OUT
+        OUT,
+        MAP // Read-only, cells are views into a memory mapping of the file
+    };
+
+    enum class Type
+    {
+        TEXT = 0,
+        INTEGER,
+        REAL
+    };
+
+    CSV() = default;
+
+    CSV(const std::string& _file_name, Mode _mode = Mode::OUT)
+    {
+        setFileName(_file_name);
+        setMode(_mode);
+        if(allowReading()) {
+            read();
+        }
+    }
+
+    // Collects the cells of one row on the calling thread so the row can be
+    // added with a single appendRow() call.
+    class RowBuilder
+    {
+    public:
+        void add(std::string_view value)
+        {
+            data.append(value.data(), value.size());
+            lengths.push_back(value.size());
+        }
+
+        void clear()
+        {
+            data.clear();
+            lengths.clear();
+        }
+
+    private:
+        friend class CSV;
+        std::string data;
+        std::vector<std::uint32_t> lengths;
+    };
+
+    void set(unsigned int row, unsigned int column, const std::string& value)
+    {
+        if(mode == Mode::MAP) {
+            throw std::runtime_error("A memory mapped CSV file is read-only.");
+        }
+
+        if(shard_count != 0) {
+            Shard& shard = shards[row % shard_count];
+            {
+                std::lock_guard<std::mutex> guard(shard.m);
+                shard.cells.push_back(PendingCell { row, column, shard.arena.size(), static_cast<std::uint32_t>(value.size()) });
+                shard.arena.append(value);
+            }
+            raise(max_height, row+1);
+            raise(max_width, column+1);
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(table_m);
+        assign(row, column, value);
+    }
+
+    // Adds a row below every row written so far and returns its index. In
+    // concurrent mode the index is reserved with one atomic increment and the
+    // cells are queued under a single shard lock. Rows set() past the end while
+    // rows are being appended may be given the same index.
+    unsigned int appendRow(const RowBuilder& builder)
+    {
+        if(mode == Mode::MAP) {
+            throw std::runtime_error("A memory mapped CSV file is read-only.");
+        }
+
+        unsigned int width = builder.lengths.size();
+        if(shard_count != 0) {
+            unsigned int row = max_height.fetch_add(1);
+            Shard& shard = shards[row % shard_count];
+            {
+                std::lock_guard<std::mutex> guard(shard.m);
+                std::uint64_t base = shard.arena.size();
+                shard.arena.append(builder.data);
+                for(unsigned int c = 0; c < width; ++c) {
+                    shard.cells.push_back(PendingCell { row, c, base, builder.lengths[c] });
+                    base += builder.lengths[c];
+                }
+            }
+            raise(max_width, width);
+            return row;
+        }
+
+        std::lock_guard<std::mutex> guard(table_m);
+        unsigned int row = max_height;
+        resizeRows(row+1);
+        std::size_t offset = 0;
+        for(unsigned int c = 0; c < width; ++c) {
+            assign(row, c, std::string_view(builder.data.data() + offset, builder.lengths[c]));
+            offset += builder.lengths[c];
+        }
+        return row;
+    }
+
+    // Switches set() and appendRow() to a path built for many writer threads.
+    // Cells are queued in one of shard_count shards picked by row, each with its
+    // own lock and arena, so threads writing different rows rarely meet. Queued
+    // cells become visible to get(), getTable(), column() and the index lookups
+    // after sync(), until then those read the table as of the last sync. The
+    // operations that change or write out the table sync first.
+    void enableConcurrentWrites(unsigned int _shard_count = 64)
+    {
+        disableConcurrentWrites();
+        if(_shard_count == 0) { return; }
+        shards.reset(new Shard[_shard_count]);
+        shard_count = _shard_count;
+    }
+
+    void disableConcurrentWrites()
+    {
+        sync();
+        shards.reset();
+        shard_count = 0;
+    }
+
+    // Moves the cells queued by concurrent writers into the table, in the order
+    // they were written for each row.
+    void sync()
+    {
+        if(shard_count == 0) { return; }
+
+        std::lock_guard<std::mutex> guard(table_m);
+        unsigned int height = max_height;
+        unsigned int width = max_width;
+        columns.resize(width);
+        for(auto& col : columns) {
+            col.cells.resize(height);
+            if(col.type == Type::INTEGER) { col.integers.resize(height); }
+            if(col.type == Type::REAL) { col.reals.resize(height); }
+        }
+        stored_height = height;
+        stored_width = width;
+
+        for(unsigned int i = 0; i < shard_count; ++i) {
+            Shard& shard = shards[i];
+            std::lock_guard<std::mutex> shard_guard(shard.m);
+            for(const auto& pending : shard.cells) {
+                assign(pending.row, pending.column, std::string_view(shard.arena.data() + pending.offset, pending.length));
+            }
+            shard.cells.clear();
+            shard.arena.clear();
+        }
+    }
+
+    void append(const std::map<unsigned int, std::map<unsigned int, std::string>>& other_table)
+    {
+        unsigned int row = max_height;
+        unsigned int column = 0;
+        for(const auto& r : other_table) {
+            for(const auto& c : r.second) {
+                set(row, column, c.second);
+                column++;
+            }
+            row++;
+            column = 0;
+        }
+        if(row > max_height) {
+            std::lock_guard<std::mutex> guard(table_m);
+            resizeRows(row);
+        }
+    }
+
+    // Appends the rows of another table below this one, copying the cell bytes
+    // column by column into this table's arena. Cells either table still has
+    // queued from concurrent writers are synced first.
+    void append(CSV& csv)
+    {
+        if(mode == Mode::MAP) {
+            throw std::runtime_error("A memory mapped CSV file is read-only.");
+        }
+
+        sync();
+        csv.sync();
+        std::unique_lock<std::mutex> guard(table_m, std::defer_lock);
+        std::unique_lock<std::mutex> other_guard(csv.table_m, std::defer_lock);
+        if(&csv == this) {
+            guard.lock();
+        } else {
+            std::lock(guard, other_guard);
+        }
+
+        unsigned int first_row = max_height;
+        unsigned int other_height = csv.stored_height;
+        unsigned int other_width = csv.stored_width;
+        if(other_width > max_width) { resizeColumns(other_width); }
+        resizeRows(first_row + other_height);
+
+        for(unsigned int c = 0; c < other_width; ++c) {
+            Column& col = columns[c];
+            const Column& other_col = csv.columns[c];
+            for(unsigned int r = 0; r < other_height; ++r) {
+                std::string_view value = csv.view(other_col.cells[r]);
+                Cell& cell = col.cells[first_row + r];
+                cell.offset = arena.size();
+                cell.length = value.size();
+                cell.mapped = false;
+                arena.append(value.data(), value.size());
+            }
+            if(col.type != Type::TEXT) { parseColumn(c, col.type); }
+        }
+    }
+
+    void append(const std::string& file_n)
+    {
+        CSV file(file_n, Mode::MAP);
+        append(file);
+    }
+
+    // Appends the records of one CSV file to the end of another without loading
+    // either of them, streaming the bytes through a fixed size buffer. A newline
+    // is inserted first if the destination does not already end with one.
+    static void append(const std::string& destination, const std::string& source)
+    {
+        int in = ::open(source.c_str(), O_RDONLY);
+        if(in < 0) {
+            throw std::runtime_error(source + " could not be opened for reading.");
+        }
+        int out = ::open(destination.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if(out < 0) {
+            ::close(in);
+            throw std::runtime_error(destination + " could not be opened for writing.");
+        }
+
+        auto fail = [&](const std::string& message) {
+            ::close(in);
+            ::close(out);
+            throw std::runtime_error(message);
+        };
+
+        struct stat st;
+        char last = '\n';
+        if(fstat(out, &st) == 0 && st.st_size > 0 && pread(out, &last, 1, st.st_size - 1) != 1) {
+            fail("Failed to read from " + destination + ".");
+        }
+        if(last != '\n' && ::write(out, "\n", 1) != 1) {
+            fail("Failed to write to " + destination + ".");
+        }
+
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::vector<char> buffer(1 << 16);
+        for(;;) {
+            ssize_t n = ::read(in, buffer.data(), buffer.size());
+            if(n < 0 && errno == EINTR) { continue; }
+            if(n < 0) { fail("Failed to read from " + source + "."); }
+            if(n == 0) { break; }
+            for(ssize_t written = 0; written < n;) {
+                ssize_t w = ::write(out, buffer.data() + written, n - written);
+                if(w < 0 && errno == EINTR) { continue; }
+                if(w < 0) { fail("Failed to write to " + destination + "."); }
+                written += w;
+            }
+        }
+
+        ::close(in);
+        ::close(out);
+    }
+
+    void write()
+    {
+        if(allowWriting()) {
+
+            if(file_name == "") {
+                throw std::runtime_error("CSV file name cannot be blank if you want to write out.");
+            }
+
+            sync();
+            std::lock_guard<std::mutex> guard(file_m);
+            std::lock_guard<std::mutex> table_guard(table_m);
+            CSVWriter file(file_name);
+
+            for(unsigned int y = 0; y < max_height; ++y) {
+                for(unsigned int x = 0; x < max_width; ++x) {
+                    file.writeField(view(columns[x].cells[y]));
+                }
+                file.endRow();
+            }
+            file.close();
+        } else {
+            throw std::runtime_error("The current CSV file mode does not allow for writing.\n");
+        }
+    }
+
+    // Swaps rows and columns. Only the cell descriptors move, the bytes in the
+    // arena stay where they are. The copy goes through square tiles so the rows
+    // read from the source columns and the rows written to the new columns both
+    // stay in cache, and large tables split the tiles across threads.
+    void transpose()
+    {
+        if(mode == Mode::MAP) {
+            throw std::runtime_error("A memory mapped CSV file is read-only.");
+        }
+
+        sync();
+        std::lock_guard<std::mutex> guard(table_m);
+
+        const unsigned int height = max_height;
+        const unsigned int width = max_width;
+        const unsigned int tile = 64;
+        const unsigned int strips = (height + tile - 1) / tile;
+
+        unsigned int count = 1;
+        if(static_cast<std::uint64_t>(height) * width >= min_parallel_cells) {
+            count = std::max(1u, std::min(threadCount(), strips));
+        }
+
+        // Each thread owns every count-th strip of new columns, so no two
+        // threads write the same vector.
+        std::vector<Column> transposed(height);
+        parallelFor(count, [&](unsigned int thread) {
+            for(unsigned int r0 = thread * tile; r0 < height; r0 += count * tile) {
+                unsigned int r1 = std::min(height, r0 + tile);
+                for(unsigned int r = r0; r < r1; ++r) {
+                    transposed[r].cells.resize(width);
+                }
+                for(unsigned int c0 = 0; c0 < width; c0 += tile) {
+                    unsigned int c1 = std::min(width, c0 + tile);
+                    for(unsigned int c = c0; c < c1; ++c) {
+                        const Cell* source = columns[c].cells.data();
+                        for(unsigned int r = r0; r < r1; ++r) {
+                            transposed[r].cells[c] = source[r];
+                        }
+                    }
+                }
+            }
+        });
+
+        version++;
+        columns.swap(transposed);
+        setDimensions(width, height);
+    }
+
+    void read()
+    {
+        if(allowReading())
+        {
+            if(file_name == "") {
+                throw std::runtime_error("CSV file name cannot be blank if you want to read in a file.");
+            }
+
+            sync();
+            std::lock_guard<std::mutex> guard(file_m);
+            if(mode == Mode::MAP) {
+                if(!mapping.open(file_name)) {
+                    throw std::runtime_error(file_name + " could not be opened for reading.");
+                }
+                std::lock_guard<std::mutex> table_guard(table_m);
+                load(mapping.data, mapping.size, true);
+                return;
+            }
+
+            std::ifstream file(file_name, std::ios::binary);
+            if(file.is_open())
+            {
+                // The file becomes the arena, cells are indexed in place.
+                std::string data;
+                file.seekg(0, std::ios::end);
+                data.resize(file.tellg());
+                file.seekg(0, std::ios::beg);
+                file.read(&data[0], data.size());
+                file.close();
+
+                std::lock_guard<std::mutex> table_guard(table_m);
+                arena.swap(data);
+                load(arena.data(), arena.size(), false);
+            } else {
+                throw std::runtime_error(file_name + " could not be opened for reading.");
+            }
+        } else {
+          throw std::runtime_error("CSV file mode is not set to allow for reading.");
+        }
+
+    }
+
+    void clear()
+    {
+        sync();
+        std::lock_guard<std::mutex> guard(table_m);
+        version++;
+        columns.clear();
+        arena.clear();
+        indexes.clear();
+        mapping.reset();
+        setDimensions(0, 0);
+    }
+
+    // Returns a view of the cell, or an empty view when the cell does not exist.
+    // In MAP mode the view points directly into the mapped file and stays valid
+    // for as long as this object does. Otherwise it points into the arena and is
+    // invalidated by the next modification of the table.
+    std::string_view get(unsigned int row, unsigned int column) const
+    {
+        if(row >= stored_height || column >= stored_width) { return {}; }
+        return view(columns[column].cells[row]);
+    }
+
+    // Parses a column once into a typed array. Empty cells become zero, any other
+    // cell that does not parse throws and leaves the column as it was.
+    void setColumnType(unsigned int column, Type type)
+    {
+        sync();
+        std::lock_guard<std::mutex> guard(table_m);
+        if(column+1 > max_width) {
+            if(mode == Mode::MAP) {
+                throw std::out_of_range("Column " + std::to_string(column) + " does not exist.");
+            }
+            resizeColumns(column+1);
+        }
+        parseColumn(column, type);
+    }
+
+    Type getColumnType(unsigned int column) const
+    {
+        return column < stored_width ? columns[column].type : Type::TEXT;
+    }
+
+    std::int64_t getInteger(unsigned int row, unsigned int column) const
+    {
+        if(getColumnType(column) != Type::INTEGER) {
+            throw std::runtime_error("Column " + std::to_string(column) + " is not an integer column.");
+        }
+        return row < stored_height ? columns[column].integers[row] : 0;
+    }
+
+    double getReal(unsigned int row, unsigned int column) const
+    {
+        if(getColumnType(column) != Type::REAL) {
+            throw std::runtime_error("Column " + std::to_string(column) + " is not a real column.");
+        }
+        return row < stored_height ? columns[column].reals[row] : 0.0;
+    }
+
+    // Extracts a whole column as a contiguous array of std::int64_t, double or
+    // std::string_view, parsing every cell once with std::from_chars. Empty cells
+    // become zero. A cell that does not parse becomes zero too and its row is
+    // appended to errors, or, without errors, throws.
+    template <typename T>
+    std::vector<T> column(unsigned int column, std::vector<unsigned int>* errors = nullptr) const
+    {
+        std::lock_guard<std::mutex> guard(table_m);
+        if(column >= stored_width) {
+            throw std::out_of_range("Column " + std::to_string(column) + " does not exist.");
+        }
+        return extract<T>(column, errors);
+    }
+
+    // Guesses the type of every text column from its first sample_rows non-empty
+    // cells, then converts the columns where every cell fits the guess, so later
+    // reads skip the text entirely. A column that turns out to hold a value of
+    // a wider type is retried as real and then left as text. Returns the type of
+    // every column.
+    std::vector<Type> inferColumnTypes(unsigned int sample_rows = 100)
+    {
+        sync();
+        std::lock_guard<std::mutex> guard(table_m);
+        std::vector<Type> types(max_width, Type::TEXT);
+        std::vector<unsigned int> errors;
+
+        for(unsigned int c = 0; c < max_width; ++c) {
+            Column& col = columns[c];
+            if(col.type != Type::TEXT) {
+                types[c] = col.type;
+                continue;
+            }
+
+            bool integer = true;
+            bool real = true;
+            unsigned int sampled = 0;
+            for(unsigned int r = 0; r < max_height && sampled < sample_rows && real; ++r) {
+                std::string_view text = view(col.cells[r]);
+                if(text.empty()) { continue; }
+                std::int64_t i;
+                double d;
+                integer = integer && parseInteger(text, i);
+                real = parseReal(text, d);
+                sampled++;
+            }
+            if(sampled == 0 || !real) { continue; }
+
+            if(integer) {
+                errors.clear();
+                std::vector<std::int64_t> integers = extract<std::int64_t>(c, &errors);
+                if(errors.empty()) {
+                    col.type = types[c] = Type::INTEGER;
+                    col.integers.swap(integers);
+                    continue;
+                }
+            }
+
+            errors.clear();
+            std::vector<double> reals = extract<double>(c, &errors);
+            if(errors.empty()) {
+                col.type = types[c] = Type::REAL;
+                col.reals.swap(reals);
+            }
+        }
+        return types;
+    }
+
+    // Rows of a table in some order, as row indices into the table. A view
+    // holds no cells, get() reads through to the table. So the table must
+    // outlive the view, and changes made after sortBy() show in the old order.
+    class View
+    {
+    public:
+        using const_iterator = std::vector<unsigned int>::const_iterator;
+
+        std::size_t size() const { return order.size(); }
+        bool empty() const { return order.empty(); }
+
+        // Row of the table at position i of the view
+        unsigned int row(std::size_t i) const { return order[i]; }
+
+        std::string_view get(std::size_t i, unsigned int column) const
+        {
+            return csv->get(order[i], column);
+        }
+
+        const_iterator begin() const { return order.begin(); }
+        const_iterator end() const { return order.end(); }
+
+    private:
+        friend class CSV;
+        View(const CSV* _csv, std::vector<unsigned int> _order) : csv(_csv), order(std::move(_order)) {}
+
+        const CSV* csv;
+        std::vector<unsigned int> order;
     };
 
-    CSV() = default;
+    // Indexes a column so findRows() and join() find rows by value without a
+    // scan. The hash index matches cells on their text. The ordered index also
+    // keeps every row sorted as sortBy() does, for findRange(). An index is
+    // rebuilt on its next use after the table changes, so build it once the
+    // table is filled rather than between edits.
+    void buildIndex(unsigned int column, bool ordered = false)
+    {
+        sync();
+        std::lock_guard<std::mutex> guard(table_m);
+        index(column, ordered);
+    }
+
+    void dropIndex(unsigned int column)
+    {
+        std::lock_guard<std::mutex> guard(table_m);
+        indexes.erase(column);
+    }
 
-    CSV(const std::string& _file_name, Mode _mode = Mode::OUT)
+    // Returns the rows whose cell in column is value, in row order. Builds the
+    // column's hash index on first use.
+    std::vector<unsigned int> findRows(unsigned int column, std::string_view value)
     {
-        setFileName(_file_name);
-        setMode(_mode);
-        if(allowReading()) {
-            read();
+        std::lock_guard<std::mutex> guard(table_m);
+        const Index& idx = index(column, false);
+        std::vector<unsigned int> rows;
+        for(unsigned int r = idx.heads[bucket(idx, value)]; r != 0; r = idx.next[r - 1]) {
+            if(view(columns[column].cells[r - 1]) == value) {
+                rows.push_back(r - 1);
+            }
         }
+        return rows;
     }
 
-    void set(unsigned int row, unsigned int column, const std::string& value)
+    // Returns the rows whose cell in column is at least low and below high, in
+    // the order of sortBy(). Typed columns compare as numbers, so the bounds
+    // must parse as the column's type. Builds the ordered index on first use.
+    std::vector<unsigned int> findRange(unsigned int column, std::string_view low, std::string_view high)
     {
         std::lock_guard<std::mutex> guard(table_m);
+        const Index& idx = index(column, true);
+        const Column& col = columns[column];
+        std::pair<std::size_t, std::size_t> range;
+        if(col.type == Type::INTEGER) {
+            range = boundRange(idx.order, [&](unsigned int r) { return col.integers[r]; }, bound<std::int64_t>(low), bound<std::int64_t>(high));
+        } else if(col.type == Type::REAL) {
+            range = boundRange(idx.order, [&](unsigned int r) { return col.reals[r]; }, bound<double>(low), bound<double>(high));
+        } else {
+            range = boundRange(idx.order, [&](unsigned int r) { return view(col.cells[r]); }, low, high);
+        }
+        return std::vector<unsigned int>(idx.order.begin() + range.first, idx.order.begin() + range.second);
+    }
+
+    // Every pair of a row of this table and a row of other whose cells in the
+    // two columns have the same text, ordered by row of this table and then of
+    // other. Probes other's hash index, building it if needed, so index the
+    // larger table and call join() on the smaller one.
+    std::vector<std::pair<unsigned int, unsigned int>> join(unsigned int column, CSV& other, unsigned int other_column)
+    {
+        sync();
+        other.sync();
+        std::unique_lock<std::mutex> guard(table_m, std::defer_lock);
+        std::unique_lock<std::mutex> other_guard(other.table_m, std::defer_lock);
+        if(&other == this) {
+            guard.lock();
+        } else {
+            std::lock(guard, other_guard);
+        }
 
-        if(row+1 > max_height) { max_height = row+1; }
-        if(column+1 > max_width) { max_width = column+1; }
+        if(column >= stored_width) {
+            throw std::out_of_range("Column " + std::to_string(column) + " does not exist.");
+        }
+        const Index& idx = other.index(other_column, false);
+        const std::vector<Cell>& cells = columns[column].cells;
+        const std::vector<Cell>& other_cells = other.columns[other_column].cells;
 
-        auto& cell = table[row][column];
-        if(write_protection) {
-            if(cell == "") {
-                cell = value;
+        std::vector<std::pair<unsigned int, unsigned int>> pairs;
+        for(unsigned int row = 0; row < cells.size(); ++row) {
+            std::string_view value = view(cells[row]);
+            for(unsigned int r = idx.heads[bucket(idx, value)]; r != 0; r = idx.next[r - 1]) {
+                if(other.view(other_cells[r - 1]) == value) {
+                    pairs.emplace_back(row, r - 1);
+                }
             }
-        } else {
-            cell = value;
         }
-        
+        return pairs;
     }
-    
-    void append(const std::map<unsigned int, std::map<unsigned int, std::string>>& other_table)
+
+    // Returns the rows ordered by column without moving any cell. The sort is
+    // stable, so rows with equal cells keep their order. Typed columns sort as
+    // numbers, with NaN last, and text sorts bytewise.
+    View sortBy(unsigned int column, bool descending = false) const
     {
-        unsigned int row = max_height;
-        unsigned int column = 0;
-        for(const auto& r : other_table) {
-            for(const auto& c : r.second) {
-                set(row, column, c.second);
-                column++;
+        std::lock_guard<std::mutex> guard(table_m);
+        if(column >= stored_width) {
+            throw std::out_of_range("Column " + std::to_string(column) + " does not exist.");
+        }
+
+        auto found = indexes.find(column);
+        if(!descending && found != indexes.end() && found->second.ordered && fresh(found->second, column)) {
+            return View(this, found->second.order);
+        }
+        return View(this, sortRows(column, descending));
+    }
+
+    // Compatibility view of the table in the old nested map layout. This copies
+    // every cell, prefer get() or the column accessors.
+    std::map<unsigned int, std::map<unsigned int, std::string>> getTable() const
+    {
+        std::map<unsigned int, std::map<unsigned int, std::string>> table;
+        for(unsigned int r = 0; r < stored_height; ++r) {
+            auto& row = table[r];
+            for(unsigned int c = 0; c < stored_width; ++c) {
+                row.emplace_hint(row.end(), c, std::string(view(columns[c].cells[r])));
             }
-            row++;
-            column = 0;
         }
-        max_height = row;
+        return table;
     }
 
-    void append(const CSV& csv)
+    void enableOverwriteProtection()
     {
-        auto other_table = csv.getTable();
-        append(other_table);
+        write_protection = true;
     }
 
-    void append(const std::string& file_n)
+    void disableOverwriteProtection()
     {
-        CSV file(file_n, Mode::IN);
-        append(file.getTable());
+        write_protection = false;
     }
 
-    void write()
+    unsigned int getLastRow()
     {
-        if(allowWriting()) {
+        return max_height;
+    }
 
-            if(file_name == "") {
-                throw std::runtime_error("CSV file name cannot be blank if you want to write out.");
-            }
+    unsigned int getLastColumn()
+    {
+        return max_width;
+    }
 
-            std::lock_guard<std::mutex> guard(file_m);
-            std::ofstream file(file_name);
+    void setFileName(const std::string& _file_name)
+    {
+        file_name = _file_name;
+    }
 
-            if(file.is_open()) {
-                for(int y = 0; y < max_height; ++y) {
-                    for(int x = 0; x < max_width; ++x) {
-                        file << table[y][x];
-                        if(x < max_width-1) { file << ","; }
-                    }
-                    if(y < max_height-1){ file << "\n"; }
+    void setMode(Mode _mode)
+    {
+        mode = _mode;
+    }
+
+    // Number of threads read() and transpose() may use, 0 means one per hardware
+    // thread. Files are only split when every thread gets at least a megabyte,
+    // tables are only split from a million cells.
+    void setThreadCount(unsigned int _threads)
+    {
+        threads = _threads;
+    }
+
+    bool allowReading()
+    {
+        return (mode == Mode::INOUT || mode == Mode::IN || mode == Mode::MAP);
+    }
+
+    bool allowWriting()
+    {
+        return (mode == Mode::INOUT || mode == Mode::OUT);
+    }
+
+private:
+    // Read-only memory mapping of a whole file, unmapped on destruction.
+    struct MappedFile
+    {
+        const char* data { nullptr };
+        std::size_t size { 0 };
+
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile()
+        {
+            reset();
+        }
+
+        bool open(const std::string& path)
+        {
+            reset();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if(fd < 0) { return false; }
+
+            struct stat st;
+            if(fstat(fd, &st) != 0) {
+                ::close(fd);
+                return false;
+            }
+
+            if(st.st_size > 0) {
+                void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(ptr == MAP_FAILED) {
+                    ::close(fd);
+                    return false;
                 }
-                file.close();
+                madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(ptr);
+                size = st.st_size;
             }
-        } else {
-            throw std::runtime_error("The current CSV file mode does not allow for writing.\n");
+            ::close(fd);
+            return true;
         }
-    }
 
-    void transpose()
-    {
-        std::map<unsigned int, std::map<unsigned int, std::string>> temp_table;
-        unsigned int row = 0;
-        unsigned int column = 0;
-        for(const auto& r : table)
+        void reset()
         {
-            for(const auto& c : r.second)
-            {
-                temp_table[column][row] = c.second;
-                column++;
+            if(data != nullptr) {
+                munmap(const_cast<char*>(data), size);
             }
-            row++;
-            column = 0;
+            data = nullptr;
+            size = 0;
         }
-        table = temp_table;
-        unsigned int old_max_height = max_height;
-        max_height = max_width;
-        max_width = old_max_height;
+    };
+
+    // Location of a cell's bytes, either in the arena or in the mapped file.
+    struct Cell
+    {
+        std::uint64_t offset { 0 };
+        std::uint32_t length { 0 };
+        bool mapped          { false };
+    };
+
+    // A column is a dense array of cells, stored_height long. Typed columns keep a
+    // parsed copy of every cell alongside the text.
+    struct Column
+    {
+        std::vector<Cell> cells;
+        Type type { Type::TEXT };
+        std::vector<std::int64_t> integers;
+        std::vector<double> reals;
+    };
+
+    std::string_view view(const Cell& cell) const
+    {
+        const char* base = cell.mapped ? mapping.data : arena.data();
+        return std::string_view(base + cell.offset, cell.length);
     }
 
-    void read()
+    // Hash index of a column. heads maps a bucket to the first row in it and
+    // next chains the rows of a bucket, both as row + 1 so that 0 ends a chain.
+    // Chains run in row order. Ordered indexes also hold every row as sortBy()
+    // would order them.
+    struct Index
     {
-        if(allowReading())
-        {
-            if(file_name == "") {
-                throw std::runtime_error("CSV file name cannot be blank if you want to read in a file.");
+        std::uint64_t version { 0 };
+        std::vector<unsigned int> heads;
+        std::vector<unsigned int> next;
+        std::vector<unsigned int> order;
+        bool ordered { false };
+    };
+
+    static std::size_t bucket(const Index& idx, std::string_view value)
+    {
+        return std::hash<std::string_view>()(value) & (idx.heads.size() - 1);
+    }
+
+    bool fresh(const Index& idx, unsigned int column) const
+    {
+        return !idx.heads.empty() && idx.version == version && idx.next.size() == columns[column].cells.size();
+    }
+
+    // Returns the index of column, building the parts that are missing or out
+    // of date. table_m must be held.
+    const Index& index(unsigned int column, bool ordered)
+    {
+        if(column >= stored_width) {
+            throw std::out_of_range("Column " + std::to_string(column) + " does not exist.");
+        }
+
+        Index& idx = indexes[column];
+        if(!fresh(idx, column)) {
+            const std::vector<Cell>& cells = columns[column].cells;
+            const unsigned int height = cells.size();
+            std::size_t buckets = 1;
+            while(buckets < height) { buckets <<= 1; }
+
+            idx.heads.assign(buckets, 0);
+            idx.next.assign(height, 0);
+            for(unsigned int r = height; r-- > 0;) {
+                std::size_t b = bucket(idx, view(cells[r]));
+                idx.next[r] = idx.heads[b];
+                idx.heads[b] = r + 1;
             }
+            std::vector<unsigned int>().swap(idx.order);
+            idx.ordered = false;
+            idx.version = version;
+        }
+        if(ordered && !idx.ordered) {
+            idx.order = sortRows(column, false);
+            idx.ordered = true;
+        }
+        return idx;
+    }
 
-            std::lock_guard<std::mutex> guard(file_m);
-            std::ifstream file(file_name);
-            if(file.is_open())
-            {
-                unsigned int row = 0;
-                unsigned int column = 0;
-                for(std::string line; std::getline(file, line);)
-                {
-                    std::vector<std::string> result;
-                    std::istringstream iss(line);
-
-                    for (std::string token; std::getline(iss, token, ','); )
-                    {
-                        set(row, column, token);
-                        column++;
-                    }
-                    row++;
-                    column = 0;
-                }
-                file.close();
+    // Rows of the table stably sorted by column. table_m must be held.
+    std::vector<unsigned int> sortRows(unsigned int column, bool descending) const
+    {
+        const Column& col = columns[column];
+        std::vector<unsigned int> rows(col.cells.size());
+        for(unsigned int r = 0; r < rows.size(); ++r) {
+            rows[r] = r;
+        }
+
+        auto sortWith = [&](auto key) {
+            if(descending) {
+                std::stable_sort(rows.begin(), rows.end(), [&](unsigned int a, unsigned int b) { return before(key(b), key(a)); });
             } else {
-                throw std::runtime_error(file_name + " could not be opened for reading.");
+                std::stable_sort(rows.begin(), rows.end(), [&](unsigned int a, unsigned int b) { return before(key(a), key(b)); });
             }
+        };
+        if(col.type == Type::INTEGER) {
+            sortWith([&](unsigned int r) { return col.integers[r]; });
+        } else if(col.type == Type::REAL) {
+            sortWith([&](unsigned int r) { return col.reals[r]; });
         } else {
-          throw std::runtime_error("CSV file mode is not set to allow for reading.");  
+            sortWith([&](unsigned int r) { return view(col.cells[r]); });
         }
-        
+        return rows;
     }
 
-    void clear()
+    template <typename T>
+    static bool before(const T& a, const T& b)
     {
-        for(auto& r : table) {
-            r.second.clear();
+        return a < b;
+    }
+
+    // NaN sorts after every number so the order stays strict and weak
+    static bool before(double a, double b)
+    {
+        return a < b || (std::isnan(b) && !std::isnan(a));
+    }
+
+    // Positions in order of the rows whose key is at least low and below high
+    template <typename K, typename T>
+    static std::pair<std::size_t, std::size_t> boundRange(const std::vector<unsigned int>& order, K key, const T& low, const T& high)
+    {
+        auto below = [&](unsigned int r, const T& value) { return before(T(key(r)), value); };
+        auto first = std::lower_bound(order.begin(), order.end(), low, below);
+        auto last = std::lower_bound(first, order.end(), high, below);
+        return { first - order.begin(), last - order.begin() };
+    }
+
+    template <typename T>
+    static T bound(std::string_view text)
+    {
+        T value;
+        bool parsed;
+        if constexpr(std::is_same<T, std::int64_t>::value) {
+            parsed = parseInteger(text, value);
+        } else {
+            parsed = parseReal(text, value);
         }
-        table.clear();
+        if(!parsed) {
+            throw std::invalid_argument("\"" + std::string(text) + (std::is_same<T, std::int64_t>::value ? "\" is not an integer." : "\" is not a real number."));
+        }
+        return value;
     }
 
-    const std::string& get(unsigned int row, unsigned int column)
+    // A cell written in concurrent mode, waiting for sync().
+    struct PendingCell
+    {
+        unsigned int row;
+        unsigned int column;
+        std::uint64_t offset;
+        std::uint32_t length;
+    };
+
+    struct alignas(64) Shard
+    {
+        std::mutex m;
+        std::string arena;
+        std::vector<PendingCell> cells;
+    };
+
+    // Lock-free running maximum
+    static void raise(std::atomic<unsigned int>& value, unsigned int candidate)
     {
-        return table[row][column];
+        unsigned int current = value.load(std::memory_order_relaxed);
+        while(current < candidate && !value.compare_exchange_weak(current, candidate, std::memory_order_relaxed)) {}
     }
 
-    const std::map<unsigned int, std::map<unsigned int, std::string>>& getTable() const
+    // Writes a cell, growing the table as needed. table_m must be held.
+    void assign(unsigned int row, unsigned int column, std::string_view value)
     {
-        return table;
+        if(column+1 > columns.size()) { resizeColumns(column+1); }
+        if(row+1 > columns[column].cells.size()) { resizeRows(row+1); }
+
+        Column& col = columns[column];
+        Cell& cell = col.cells[row];
+        if(write_protection && cell.length != 0) {
+            return;
+        }
+        version++;
+
+        // Parse before touching the cell so a bad value leaves the table untouched.
+        if(col.type == Type::INTEGER) {
+            std::int64_t integer;
+            if(!parseInteger(value, integer)) {
+                throw std::invalid_argument("\"" + std::string(value) + "\" is not an integer.");
+            }
+            col.integers[row] = integer;
+        } else if(col.type == Type::REAL) {
+            double real;
+            if(!parseReal(value, real)) {
+                throw std::invalid_argument("\"" + std::string(value) + "\" is not a real number.");
+            }
+            col.reals[row] = real;
+        }
+
+        // Reuse the existing bytes when the new value fits, otherwise grow the arena.
+        if(!cell.mapped && value.size() <= cell.length) {
+            std::memcpy(&arena[cell.offset], value.data(), value.size());
+        } else {
+            cell.offset = arena.size();
+            cell.mapped = false;
+            arena.append(value.data(), value.size());
+        }
+        cell.length = value.size();
     }
 
-    void enableOverwriteProtection()
+    void setDimensions(unsigned int height, unsigned int width)
     {
-        write_protection = true;
+        max_height = height;
+        max_width = width;
+        stored_height = height;
+        stored_width = width;
     }
 
-    void disableOverwriteProtection()
+    void resizeColumns(unsigned int width)
     {
-        write_protection = false;
+        unsigned int old_width = columns.size();
+        version++;
+        columns.resize(width);
+        for(unsigned int c = old_width; c < width; ++c) {
+            columns[c].cells.resize(stored_height);
+        }
+        max_width = width;
+        stored_width = width;
     }
 
-    unsigned int getLastRow()
+    void resizeRows(unsigned int height)
     {
-        return max_height;
+        version++;
+        for(auto& col : columns) {
+            col.cells.resize(height);
+            if(col.type == Type::INTEGER) { col.integers.resize(height); }
+            if(col.type == Type::REAL) { col.reals.resize(height); }
+        }
+        max_height = height;
+        stored_height = height;
     }
 
-    unsigned int getLastColumn()
+    void parseColumn(unsigned int column, Type type)
     {
-        return max_width;
+        std::vector<std::int64_t> integers;
+        std::vector<double> reals;
+
+        if(type == Type::INTEGER) {
+            integers = extract<std::int64_t>(column, nullptr);
+        } else if(type == Type::REAL) {
+            reals = extract<double>(column, nullptr);
+        }
+
+        Column& col = columns[column];
+        version++;
+        col.type = type;
+        col.integers.swap(integers);
+        col.reals.swap(reals);
     }
 
-    void setFileName(const std::string& _file_name)
+    template <typename T>
+    std::vector<T> extract(unsigned int column, std::vector<unsigned int>* errors) const
     {
-        file_name = _file_name;
+        static_assert(std::is_same<T, std::int64_t>::value || std::is_same<T, double>::value || std::is_same<T, std::string_view>::value,
+            "Columns can only be extracted as std::int64_t, double or std::string_view.");
+
+        const Column& col = columns[column];
+        if constexpr(std::is_same<T, std::string_view>::value) {
+            std::vector<T> values(stored_height);
+            for(unsigned int r = 0; r < stored_height; ++r) {
+                values[r] = view(col.cells[r]);
+            }
+            return values;
+        } else {
+            // Typed columns are already parsed
+            if(std::is_same<T, std::int64_t>::value && col.type == Type::INTEGER) {
+                return std::vector<T>(col.integers.begin(), col.integers.end());
+            }
+            if(std::is_same<T, double>::value && col.type == Type::REAL) {
+                return std::vector<T>(col.reals.begin(), col.reals.end());
+            }
+            if(std::is_same<T, double>::value && col.type == Type::INTEGER) {
+                return std::vector<T>(col.integers.begin(), col.integers.end());
+            }
+
+            std::vector<T> values(stored_height);
+            for(unsigned int r = 0; r < stored_height; ++r) {
+                bool parsed;
+                if constexpr(std::is_same<T, std::int64_t>::value) {
+                    parsed = parseInteger(view(col.cells[r]), values[r]);
+                } else {
+                    parsed = parseReal(view(col.cells[r]), values[r]);
+                }
+                if(parsed) { continue; }
+
+                values[r] = 0;
+                if(errors == nullptr) {
+                    throw std::invalid_argument("Row " + std::to_string(r) + " of column " + std::to_string(column) +
+                        (std::is_same<T, std::int64_t>::value ? " is not an integer." : " is not a real number."));
+                }
+                errors->push_back(r);
+            }
+            return values;
+        }
     }
 
-    void setMode(Mode _mode)
+    static bool parseInteger(std::string_view text, std::int64_t& out)
     {
-        mode = _mode;
+        if(text.empty()) {
+            out = 0;
+            return true;
+        }
+        auto result = std::from_chars(text.data(), text.data() + text.size(), out);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size();
     }
 
-    bool allowReading()
+    static bool parseReal(std::string_view text, double& out)
     {
-        return (mode == Mode::INOUT || mode == Mode::IN);
+        if(text.empty()) {
+            out = 0.0;
+            return true;
+        }
+        auto result = std::from_chars(text.data(), text.data() + text.size(), out);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size();
     }
 
-    bool allowWriting()
+    // Cells parsed from one byte range of the input. Every column holds exactly
+    // rows cells. Unescaped cells of a mapped input live in the part's arena.
+    struct Part
     {
-        return (mode == Mode::INOUT || mode == Mode::OUT);
+        std::vector<Column> columns;
+        std::string arena;
+        unsigned int rows { 0 };
+    };
+
+    // Replaces the table with the cells of data. When more than one thread is
+    // allowed the input is cut into byte ranges that start on record boundaries
+    // and the ranges are parsed concurrently, then stitched together in order.
+    void load(const char* data, std::size_t size, bool mapped)
+    {
+        version++;
+        columns.clear();
+        if(mapped) { arena.clear(); }
+        setDimensions(0, 0);
+
+        // Unescaped cells of the in-memory input are rewritten in place.
+        char* writable = mapped ? nullptr : &arena[0];
+
+        unsigned int count = std::max<std::size_t>(1, std::min<std::size_t>(threadCount(), size / min_chunk_size));
+        if(count == 1) {
+            Part part;
+            parse(data, 0, size, writable, part);
+            columns.swap(part.columns);
+            arena.append(part.arena);
+            setDimensions(part.rows, columns.size());
+            return;
+        }
+
+        // A chunk starts after the first newline past its nominal start that is
+        // not inside a quoted field. The quote state at each nominal start is the
+        // parity of all the quotes before it, counted per chunk in parallel.
+        CSVScanner scanner;
+        std::vector<std::size_t> starts(count + 1, size);
+        std::vector<std::size_t> quotes(count, 0);
+        parallelFor(count, [&](unsigned int i) {
+            std::size_t begin = size / count * i;
+            std::size_t end = i + 1 == count ? size : size / count * (i + 1);
+            quotes[i] = scanner.countQuotes(data + begin, end - begin);
+        });
+
+        starts[0] = 0;
+        bool in_quotes = false;
+        for(unsigned int i = 1; i < count; ++i) {
+            in_quotes ^= (quotes[i - 1] & 1) != 0;
+            std::size_t begin = size / count * i;
+            starts[i] = std::min(size, begin + scanner.findNewline(data + begin, size - begin, in_quotes) + 1);
+            starts[i] = std::max(starts[i], starts[i - 1]);
+        }
+
+        std::vector<Part> parts(count);
+        parallelFor(count, [&](unsigned int i) {
+            parse(data, starts[i], starts[i + 1], writable, parts[i]);
+        });
+
+        unsigned int width = 0;
+        unsigned int height = 0;
+        for(const auto& part : parts) {
+            width = std::max<unsigned int>(width, part.columns.size());
+            height += part.rows;
+        }
+
+        columns.resize(width);
+        for(auto& col : columns) {
+            col.cells.reserve(height);
+        }
+        for(auto& part : parts) {
+            std::uint64_t arena_base = arena.size();
+            arena.append(part.arena);
+            for(unsigned int c = 0; c < width; ++c) {
+                std::vector<Cell>& cells = columns[c].cells;
+                if(c < part.columns.size()) {
+                    for(Cell cell : part.columns[c].cells) {
+                        if(mapped && !cell.mapped) { cell.offset += arena_base; }
+                        cells.push_back(cell);
+                    }
+                } else {
+                    cells.resize(cells.size() + part.rows);
+                }
+            }
+        }
+
+        setDimensions(height, width);
     }
 
-private:
-    std::map<unsigned int, std::map<unsigned int, std::string>> table;
+    // Parses the records in [begin, end) of data, following RFC 4180: fields may
+    // be quoted, quoted fields may contain delimiters, newlines and escaped
+    // quotes (""), and records end with "\n" or "\r\n". The structural characters
+    // come from CSVScanner. Unquoted cells are indexed in place. Quoted cells with
+    // escapes are unescaped in place when writable is set, otherwise they are
+    // copied to the part's arena. Rows with fewer cells than the widest row are
+    // padded with empty cells.
+    static void parse(const char* data, std::size_t begin, std::size_t end, char* writable, Part& part)
+    {
+        std::vector<Column>& cols = part.columns;
+        bool mapped = writable == nullptr;
+        unsigned int row = 0;
+        unsigned int column = 0;
+        std::size_t row_start = begin;
+        std::size_t start = begin;
+
+        auto addCell = [&](std::size_t first, std::size_t last, bool terminator) {
+            if(terminator && last > first && data[last - 1] == '\r') { last--; }
+
+            Cell cell { first, static_cast<std::uint32_t>(last - first), mapped };
+            if(last > first && data[first] == '"') {
+                first++;
+                if(last > first && data[last - 1] == '"') { last--; }
+                cell.offset = first;
+                cell.length = last - first;
+                if(std::memchr(data + first, '"', last - first) != nullptr) {
+                    if(mapped) {
+                        cell.offset = part.arena.size();
+                        cell.mapped = false;
+                        part.arena.resize(part.arena.size() + (last - first));
+                        cell.length = CSVScanner::unescape(data + first, last - first, &part.arena[cell.offset]);
+                        part.arena.resize(cell.offset + cell.length);
+                    } else {
+                        cell.length = CSVScanner::unescape(data + first, last - first, writable + first);
+                    }
+                }
+            }
+
+            if(column >= cols.size()) {
+                cols.emplace_back();
+                cols.back().cells.resize(row);
+            }
+            cols[column].cells.push_back(cell);
+            column++;
+        };
+
+        auto endRow = [&]() {
+            for(unsigned int c = column; c < cols.size(); ++c) {
+                cols[c].cells.emplace_back();
+            }
+            row++;
+            column = 0;
+        };
+
+        CSVScanner scanner;
+        scanner.scan(data + begin, end - begin, false, [&](std::size_t offset, bool newline) {
+            std::size_t pos = begin + offset;
+            if(!newline) {
+                addCell(start, pos, false);
+            } else {
+                // Blank lines become rows without cells
+                if(pos > row_start && !(pos == row_start + 1 && data[row_start] == '\r')) {
+                    addCell(start, pos, true);
+                }
+                endRow();
+                row_start = pos + 1;
+            }
+            start = pos + 1;
+        });
+
+        if(start < end || column > 0) {
+            addCell(start, end, true);
+            endRow();
+        }
+
+        part.rows = row;
+    }
+
+    template <typename F>
+    static void parallelFor(unsigned int count, F&& fn)
+    {
+        std::vector<std::thread> workers;
+        workers.reserve(count - 1);
+        for(unsigned int i = 1; i < count; ++i) {
+            workers.emplace_back([&fn, i]() { fn(i); });
+        }
+        fn(0);
+        for(auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    unsigned int threadCount() const
+    {
+        if(threads != 0) { return threads; }
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::vector<Column> columns;
+    std::string arena;
+    MappedFile mapping;
     std::string file_name   { "" };
-    unsigned int max_height { 0 };
-    unsigned int max_width  { 0 };
+    std::atomic<unsigned int> max_height { 0 };
+    std::atomic<unsigned int> max_width  { 0 };
+    // Dimensions of columns. Concurrent writers only raise max_height and
+    // max_width, and sync() catches these up, so readers check against them.
+    unsigned int stored_height { 0 };
+    unsigned int stored_width  { 0 };
     Mode mode               { Mode::OUT };
     bool write_protection   { false };
-    std::mutex table_m;
+    unsigned int threads    { 1 };
+    unsigned int shard_count { 0 };
+    std::unique_ptr<Shard[]> shards;
+    std::map<unsigned int, Index> indexes;
+    std::uint64_t version   { 0 }; // Changes with every change to the table
+    static constexpr std::size_t min_chunk_size { 1 << 20 };
+    static constexpr std::uint64_t min_parallel_cells { 1 << 20 };
+    mutable std::mutex table_m;
     std::mutex file_m;
 };
\ No newline at end of file
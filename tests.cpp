@@ -0,0 +1,80 @@
+// Checks for behaviour the benchmarks do not exercise.
+//
+// make test
+#include "WeightedBag.h"
+
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    int failures = 0;
+
+    void expect(bool condition, const std::string& what)
+    {
+        if(!condition) {
+            std::cerr << "FAILED: " << what << "\n";
+            failures++;
+        }
+    }
+
+    template <typename F>
+    bool throwsInvalidArgument(F&& fn)
+    {
+        try {
+            fn();
+        } catch(const std::invalid_argument&) {
+            return true;
+        } catch(...) {
+        }
+        return false;
+    }
+
+    void testWeightedBagRejectsBadWeights()
+    {
+        const double bad[] {
+            -5.0,
+            -std::numeric_limits<double>::denorm_min(),
+            std::numeric_limits<double>::quiet_NaN(),
+            std::numeric_limits<double>::infinity()
+        };
+
+        for(WeightedBag<int>::Mode mode : { WeightedBag<int>::Mode::ALIAS, WeightedBag<int>::Mode::BINARY_SEARCH }) {
+            WeightedBag<int> bag(Xoshiro256StarStar(1));
+            bag.setMode(mode);
+            auto h = bag.addEntry(1, 1.0);
+            bag.addEntry(2, 0.0);
+
+            for(double weight : bad) {
+                std::ostringstream name;
+                name << "weight " << weight;
+                expect(throwsInvalidArgument([&] { bag.addEntry(3, weight); }), "addEntry rejects " + name.str());
+                expect(throwsInvalidArgument([&] { bag.updateWeight(h, weight); }), "updateWeight rejects " + name.str());
+            }
+
+            // The rejected calls left the bag as it was
+            expect(bag.size() == 2, "rejected weights add no entries");
+            for(int i = 0; i < 1000; ++i) {
+                if(bag.getRandom() != 1) {
+                    expect(false, "only the entry with a positive weight is drawn");
+                    break;
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    testWeightedBagRejectsBadWeights();
+
+    if(failures != 0) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "all tests passed\n";
+    return 0;
+}